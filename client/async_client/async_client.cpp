@@ -30,9 +30,9 @@ bool async_tcp_client::connect(std::string_view ip, std::string_view port)
 	if (connected_)
 		throw exception(exception::reason_id::already_connected, "async_tcp_client::connect: attempted to connect while a connection was open");
 
-	// Confirm that we have a callback set
-	if (!process_callback_)
-		throw exception(exception::reason_id::no_callback, "async_tcp_client::connect: no processing callback set");
+	// Confirm that we have a callback or handler set
+	if (handlers_.empty())
+		throw exception(exception::reason_id::no_callback, "async_tcp_client::connect: no processing callback or handler set");
 
 	addrinfo hints = {}, *result = nullptr;
 
@@ -89,32 +89,28 @@ void async_tcp_client::send_packet(packets::base_packet *const packet)
 	if (!packet)
 		throw exception(exception::reason_id::packet_nullptr, "async_tcp_client::send_packet: packet was nullptr");
 
-	std::lock_guard guard(send_mtx_);
+	// Every thread serializes with its own serializer, the member
+	// one belongs to the processing thread.
+	thread_local packets::detail::binary_serializer serializer = {};
 
-	serializer.reset();
+	// Leave room for the header, the serialized buffer is the packet as it goes out
+	serializer.reserve_header(sizeof(packets::header));
 
 	// Serialize our data
 	packet->serialize(serializer);
 
-	// Allocate a buffer for our packet
-	std::vector<std::uint8_t> packet_data(sizeof(packets::header) + serializer.get_serialized_data_length());
-
 	// Construct our packet header
 	packets::header packet_header = construct_packet_header(
 		serializer.get_serialized_data_length(),
 		packet->get_id(),
 		packets::flags::fl_none);
 
-	// Write our packet into the buffer
-	memcpy(packet_data.data(), &packet_header, sizeof(packets::header));
+	serializer.write_header(packet_header);
 
-	memcpy(
-		packet_data.data() + sizeof(packets::header),
-		serializer.get_serialized_data(),
-		serializer.get_serialized_data_length());
+	std::lock_guard guard(send_mtx_);
 
 	// Attempt to send the packet
-	if (!send_packet_internal(packet_data.data(), packet_data.size()))
+	if (!send_packet_internal(serializer.get_frame_data(), serializer.get_frame_length()))
 		disconnect_internal(disconnect_reasons::reason_error);
 }
 
@@ -123,7 +119,12 @@ void async_tcp_client::register_callback(std::function<void(async_tcp_client *co
 	if (!callback_fn)
 		throw exception(exception::reason_id::null_callback, "async_tcp_client::register_callback: no callback given");
 
-	process_callback_ = callback_fn;
+	handlers_.set_fallback(callback_fn);
+}
+
+detail::packet_stats async_tcp_client::get_packet_stats(packets::packet_id id)
+{
+	return handlers_.get_stats(id);
 }
 
 void async_tcp_client::register_disconnect_callback(std::function<void(async_tcp_client *const)> callback_fn)
@@ -131,6 +132,14 @@ void async_tcp_client::register_disconnect_callback(std::function<void(async_tcp
 	on_disconnect_callback_ = callback_fn;
 }
 
+void async_tcp_client::set_io_backend(io_backend backend)
+{
+	if (connected_)
+		throw exception(exception::reason_id::already_connected, "async_tcp_client::set_io_backend: attempted to change the backend while connected");
+
+	backend_ = backend;
+}
+
 packets::header async_tcp_client::construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags)
 {
 	packets::header packet_header = {};
@@ -149,6 +158,14 @@ bool async_tcp_client::perform_handshake()
 
 	auto buffer = reinterpret_cast<char *>(&packet_header);
 
+	// Don't wait forever on a server which doesn't answer
+	timeval timeout = {};
+	timeout.tv_sec = handshake_timeout_.count();
+
+	if (setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+		setsockopt(socket_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+		return false;
+
 	// Send our header with no body and the handshake_cl flag
 	if (!send_packet_internal(&packet_header, sizeof(packets::header)))
 		return false;
@@ -178,7 +195,11 @@ bool async_tcp_client::perform_handshake()
 	if (packet_header.magic != PACKET_MAGIC)
 		return false;
 
-	return true;
+	// From here on the receiving thread blocks until data arrives, however long it takes
+	timeout = {};
+
+	return setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != -1 &&
+		   setsockopt(socket_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != -1;
 }
 
 bool async_tcp_client::send_packet_internal(void *const data, const packets::packet_length length)
@@ -206,7 +227,14 @@ void async_tcp_client::disconnect_internal(const disconnect_reasons reason)
 	// This may be called from multiple threads
 	std::lock_guard guard(disconnect_mtx_);
 
-	connected_ = false;
+	{
+		// Taking the lock makes sure the processing thread is either
+		// waiting already or will see the change before it waits.
+		std::lock_guard process_guard(process_mtx_);
+		connected_ = false;
+	}
+
+	process_cv_.notify_all();
 
 	switch (reason)
 	{
@@ -239,57 +267,75 @@ void async_tcp_client::disconnect_internal(const disconnect_reasons reason)
 	}
 }
 
+bool async_tcp_client::has_complete_packet()
+{
+	if (process_buffer_.size() < sizeof(packets::header))
+		return false;
+
+	auto header = reinterpret_cast<packets::header *>(process_buffer_.data());
+
+	// Malformed packets have to be looked at as well
+	return header->magic != PACKET_MAGIC || header->length < sizeof(packets::header) || process_buffer_.size() >= header->length;
+}
+
 void async_tcp_client::process_data()
 {
+	std::unique_lock lock(process_mtx_);
+
 	while (true)
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		// Sleep until the receiving thread hands us a packet or we got disconnected
+		process_cv_.wait(lock, [this]
+						 { return !connected_ || has_complete_packet(); });
 
-		std::lock_guard guard(process_mtx_);
-
-		if (!connected_)
+		// Dispatch every complete packet we have. Once disconnected,
+		// this processes the packets left over before we exit.
+		while (has_complete_packet())
 		{
-			// Nothing left to process, exit
-			if (process_buffer_.size() < sizeof(packets::header))
-				break;
-
 			auto header = reinterpret_cast<packets::header *>(process_buffer_.data());
 
-			// Data partially received, exit
-			if (process_buffer_.size() < header->length)
-				break;
-
-			// Keep processing data as we have packets left
+			// Disconnect if we receive some malformed packet
+			if (header->magic != PACKET_MAGIC || header->length < sizeof(packets::header))
+			{
+				process_buffer_.clear();
+
+				lock.unlock();
+				disconnect_internal(disconnect_reasons::reason_error);
+				return;
+			}
+
+			packets::packet_id id = header->id;
+			auto data_start = process_buffer_.data() + sizeof(packets::header);
+			std::uint32_t data_length = header->length - sizeof(packets::header);
+
+			// Assign the data to our serializer
+			serializer.assign_buffer(data_start, data_length);
+
+			// Consume the packet from our buffer
+			process_buffer_.consume(data_length + sizeof(packets::header));
+
+			// Call the handler of the packet. The serializer holds its own copy
+			// of the data, so the receiving thread may carry on in the meantime.
+			if (id > packets::ids::num_preset_ids)
+			{
+				lock.unlock();
+				bool well_formed = handlers_.dispatch(this, id, serializer);
+				lock.lock();
+
+				// Treated just like a malformed header
+				if (!well_formed)
+				{
+					process_buffer_.clear();
+
+					lock.unlock();
+					disconnect_internal(disconnect_reasons::reason_error);
+					return;
+				}
+			}
 		}
 
-		if (process_buffer_.size() < sizeof(packets::header))
-			continue;
-
-		auto header = reinterpret_cast<packets::header *>(process_buffer_.data());
-
-		// Disconnect if we receive some malformed packet
-		if (header->magic != PACKET_MAGIC)
-		{
-			connected_ = false;
+		if (!connected_)
 			break;
-		}
-
-		// We have received a full packet
-		if (process_buffer_.size() < header->length)
-			continue;
-
-		auto data_start = process_buffer_.data() + sizeof(packets::header);
-		std::uint32_t data_length = header->length - sizeof(packets::header);
-
-		// Assign the data to our serializer
-		serializer.assign_buffer(data_start, data_length);
-
-		// Call our callback (it cannot be null)
-		if (header->id > packets::ids::num_preset_ids)
-			process_callback_(this, header->id, serializer);
-
-		// Erase the packet from our buffer
-		process_buffer_.erase(process_buffer_.begin(), process_buffer_.begin() + data_length + sizeof(packets::header));
 	}
 
 	process_buffer_.clear();
@@ -297,11 +343,32 @@ void async_tcp_client::process_data()
 
 void async_tcp_client::receive_data()
 {
-	std::vector<std::uint8_t> buffer(buffer_size_);
+#ifdef FI_HAS_IO_URING
+	if (backend_ == io_backend::uring)
+	{
+		detail::io_ring ring = {};
+
+		if (ring.init(ring_entries_, ring_buffers_, buffer_size_))
+		{
+			receive_data_ring(ring);
+			return;
+		}
+	}
+#endif // FI_HAS_IO_URING
 
 	while (connected_)
 	{
-		int bytes_received = recv(socket_, reinterpret_cast<char *>(buffer.data()), buffer_size_, NULL);
+		std::uint8_t *buffer = nullptr;
+		std::size_t writable = 0;
+
+		{
+			std::lock_guard guard(process_mtx_);
+
+			buffer = process_buffer_.prepare(buffer_size_);
+			writable = process_buffer_.writable();
+		}
+
+		int bytes_received = recv(socket_, reinterpret_cast<char *>(buffer), writable, 0);
 
 		switch (bytes_received)
 		{
@@ -312,11 +379,63 @@ void async_tcp_client::receive_data()
 			disconnect_internal(disconnect_reasons::reason_server_stop);
 			break;
 		default:
-			std::lock_guard guard(process_mtx_);
+			{
+				std::lock_guard guard(process_mtx_);
+				process_buffer_.commit(bytes_received);
+			}
+
+			process_cv_.notify_one();
+		}
+	}
+}
 
-			process_buffer_.insert(process_buffer_.end(), buffer.begin(), buffer.begin() + bytes_received);
+#ifdef FI_HAS_IO_URING
+void async_tcp_client::receive_data_ring(detail::io_ring &ring)
+{
+	// A single multishot receive keeps filling our provided buffers,
+	// so there is no syscall per receive anymore.
+	ring.prep_multishot_recv(socket_, 0);
+
+	while (connected_)
+	{
+		if (ring.submit_and_wait(1) == -1 && errno != EINTR)
+		{
+			disconnect_internal(disconnect_reasons::reason_error);
+			break;
 		}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		ring.for_each_completion([&](const io_uring_cqe &cqe)
+								 {
+			if (cqe.res > 0 && detail::io_ring::has_buffer(cqe))
+			{
+				auto buffer_id = detail::io_ring::get_buffer_id(cqe);
+				auto data = ring.get_buffer(buffer_id);
+
+				{
+					std::lock_guard guard(process_mtx_);
+					process_buffer_.append(data, cqe.res);
+				}
+
+				ring.recycle_buffer(buffer_id);
+				process_cv_.notify_one();
+			}
+
+			if (detail::io_ring::has_more(cqe))
+				return;
+
+			// It ends on its own once we ran out of buffers, simply rearm it
+			if (cqe.res > 0 || cqe.res == -ENOBUFS)
+			{
+				if (connected_)
+					ring.prep_multishot_recv(socket_, 0);
+
+				return;
+			}
+
+			if (cqe.res == 0) // Server disconnected us
+				disconnect_internal(disconnect_reasons::reason_server_stop);
+			else // An error occurred
+				disconnect_internal(disconnect_reasons::reason_error); });
 	}
-}
\ No newline at end of file
+}
+#endif // FI_HAS_IO_URING
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <errno.h>
 
 #else
 #error OS unknown or not supported.
@@ -28,14 +29,18 @@
 
 #include <mutex>
 #include <thread>
+#include <condition_variable>
+#include <atomic>
 #include <vector>
 #include <functional>
 #include <unordered_map>
 
+#include "../../shared/io_ring/io_ring.h"
+#include "../../shared/packet_handlers/packet_handlers.h"
 #include "../../shared/packets/packets.h"
+#include "../../shared/stream_buffer/stream_buffer.h"
 
 // TODO:
-// -add handshake timeout so we don't wait infinitely
 // -check if connected_ needs a mutex
 // -fix the stupid lag on handshake (why tf does it happen???)
 
@@ -56,14 +61,36 @@ namespace fi
 
 		void send_packet(packets::base_packet *const packet);
 
-		// The callback will be called once a packet is received.
-		// You must register your callback before you connect to
-		// the server, as not doing so will result in an exception.
+		// Registers the handler for packets of type P, which gets called with the
+		// packet already deserialized into an instance which is reused for the next
+		// one. A packet failing to deserialize disconnects us. Must be registered
+		// before connecting.
+		template <typename P, typename F>
+		void on(F handler)
+		{
+			if (connected_)
+				throw exception(exception::reason_id::already_connected, "async_tcp_client::on: attempted to register a handler while connected");
+
+			handlers_.on<P>(std::move(handler));
+		}
+
+		// The callback will be called once a packet without a handler of its own is
+		// received. You must register either this callback or a handler before you
+		// connect to the server, as not doing so will result in an exception.
 		void register_callback(std::function<void(async_tcp_client *const, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn);
 
+		// How many packets of the id were received and how many of them were malformed,
+		// only counted for packets with a handler
+		detail::packet_stats get_packet_stats(packets::packet_id id);
+
 		// This function will be called as soon as the client disconnects or has been disconnected from the server.
 		void register_disconnect_callback(std::function<void(async_tcp_client *const)> callback_fn);
 
+		// Selects how data is received. Must be set before connecting.
+		// io_backend::uring silently falls back to blocking receives if
+		// the kernel does not support it.
+		void set_io_backend(io_backend backend);
+
 	private:
 #ifdef _WIN32
 		WSADATA wsa_data_ = {};
@@ -89,28 +116,48 @@ namespace fi
 
 		void disconnect_internal(const disconnect_reasons reason);
 
+		// Whether the processing buffer starts with a complete (or malformed) packet
+		bool has_complete_packet();
+
 		// These functions are running in a thread
 		void process_data();
 		void receive_data();
+#ifdef FI_HAS_IO_URING
+		void receive_data_ring(detail::io_ring &ring);
+#endif // FI_HAS_IO_URING
 
-		bool connected_ = false;
+		std::atomic<bool> connected_ = false;
 
-		// This specifies the buffer size when receiving data.
-		// It does not affect the size of the processing queue.
+		// This specifies the minimum amount of room we make in the
+		// processing buffer when receiving, and the size of the
+		// io_uring receive buffers.
 		const std::uint32_t buffer_size_ = PACKET_BUFFER_SIZE;
 
+		// We give up on servers not completing the handshake within this time
+		const std::chrono::seconds handshake_timeout_ = std::chrono::seconds(5);
+
 		SOCKET socket_ = 0;
 
+		io_backend backend_ = io_backend::readiness;
+
+		// Size of the io_uring submission queue and amount of receive buffers
+		static constexpr std::uint32_t ring_entries_ = 8;
+		static constexpr std::uint16_t ring_buffers_ = 64;
+
 		std::mutex disconnect_mtx_ = {}, process_mtx_ = {}, send_mtx_ = {};
 
-		std::vector<std::uint8_t> process_buffer_ = {};
+		// Signaled by the receiving thread once data arrived and on disconnect
+		std::condition_variable process_cv_ = {};
+
+		detail::stream_buffer process_buffer_ = {};
 
 		std::function<void(async_tcp_client *const)> on_disconnect_callback_ = {};
-		std::function<void(async_tcp_client *const, const packets::packet_id, packets::detail::binary_serializer &)> process_callback_ = {};
+		// Our packet handlers, register_callback sets their fallback
+		detail::packet_handlers<async_tcp_client *const> handlers_ = {};
 
 		std::thread processing_thread_ = {}, receiving_thread_ = {};
 
-		// This will help us in serializing our packet data
+		// This will help us in deserializing our packet data
 		packets::detail::binary_serializer serializer = {};
 
 	public:
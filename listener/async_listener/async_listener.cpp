@@ -1,4 +1,6 @@
 #include "async_listener.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 using namespace fi;
@@ -12,14 +14,11 @@ async_udp_listener::~async_udp_listener()
 {
     stop();
 
-    if (processing_thread_.joinable())
-        processing_thread_.join();
-
     if (receiving_thread_.joinable())
         receiving_thread_.join();
 
-    if (heartbeat_thread_.joinable())
-        heartbeat_thread_.join();
+    if (expiry_thread_.joinable())
+        expiry_thread_.join();
 
     // do stuff on windows
 }
@@ -57,11 +56,20 @@ void async_udp_listener::start(std::string_view port)
         throw exception(exception::reason_id::bind_error, "async_udp_listener::start: failed to bind socket");
     }
 
+    freeaddrinfo(result);
+
+    // Kernels without it fail, datagrams are then received one by one as before
+    int enable = 1;
+    receive_offload_ = setsockopt(server_socket_, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+
+    // Sessions start counting their generations over
+    reliability_.clear();
+    reassembly_.clear();
+
     running_ = true;
 
-    processing_thread_ = std::thread(&async_udp_listener::process_data, this);
     receiving_thread_ = std::thread(&async_udp_listener::receive_data, this);
-    heartbeat_thread_ = std::thread(&async_udp_listener::run_heartbeat, this);
+    expiry_thread_ = std::thread(&async_udp_listener::run_expiry, this);
 }
 
 void async_udp_listener::stop()
@@ -74,12 +82,20 @@ void async_udp_listener::stop()
         // closesocket(server_socket_);
         close(server_socket_);
 
+        {
+            std::lock_guard guard(expiry_mtx_);
+            expiry_cv_.notify_all();
+        }
+
         if (on_stop_callback_)
             on_stop_callback_(this);
     }
 
-    connected_clients_.clear();
-    process_buffers_.clear();
+    std::lock_guard guard(session_mtx_);
+
+    sessions_.clear();
+    free_sessions_.clear();
+    session_slots_.clear();
 }
 
 bool async_udp_listener::is_running()
@@ -87,7 +103,7 @@ bool async_udp_listener::is_running()
     return running_;
 }
 
-void async_udp_listener::register_callback(std::function<void(async_udp_listener *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn)
+void async_udp_listener::register_callback(std::function<void(async_udp_listener *const, const peer_handle, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn)
 {
     if (!callback_fn)
         throw exception(exception::reason_id::null_callback, "async_udp_listener::register_callback: no callback given");
@@ -100,6 +116,53 @@ void async_udp_listener::register_stop_callback(std::function<void(async_udp_lis
     on_stop_callback_ = callback_fn;
 }
 
+void async_udp_listener::register_expire_callback(std::function<void(async_udp_listener *const, const peer_handle)> callback_fn)
+{
+    on_expire_callback_ = callback_fn;
+}
+
+void async_udp_listener::set_session_timeout(std::chrono::milliseconds timeout)
+{
+    if (running_)
+        throw exception(exception::reason_id::already_running, "async_udp_listener::set_session_timeout: attempted to change the session timeout while running");
+
+    session_timeout_ = timeout;
+}
+
+void async_udp_listener::set_max_sessions(std::size_t max_sessions)
+{
+    if (running_)
+        throw exception(exception::reason_id::already_running, "async_udp_listener::set_max_sessions: attempted to change the maximum amount of sessions while running");
+
+    max_sessions_ = max_sessions;
+}
+
+void async_udp_listener::set_reassembly_limits(std::size_t max_packet_length, std::size_t max_memory, std::chrono::milliseconds timeout)
+{
+    if (running_)
+        throw exception(exception::reason_id::already_running, "async_udp_listener::set_reassembly_limits: attempted to change the reassembly limits while running");
+
+    reassembly_.set_limits(max_packet_length, max_memory, timeout);
+}
+
+bool async_udp_listener::get_peer_address(peer_handle peer, sockaddr_storage &address)
+{
+    std::lock_guard guard(session_mtx_);
+
+    auto session = find_session(peer);
+
+    if (!session)
+        return false;
+
+    address = session->address;
+    return true;
+}
+
+bool async_udp_listener::has_receive_offload()
+{
+    return receive_offload_;
+}
+
 packets::header async_udp_listener::construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags)
 {
     packets::header packet_header = {};
@@ -112,87 +175,432 @@ packets::header async_udp_listener::construct_packet_header(packets::packet_leng
     return packet_header;
 }
 
-void async_udp_listener::process_data()
+peer_handle async_udp_listener::make_handle(std::uint32_t slot, std::uint32_t generation)
 {
-    while (running_)
-    { // The server will only process data for as long as it's running (fixme)
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return (peer_handle(generation) << 32) | slot;
+}
+
+async_udp_listener::session *async_udp_listener::find_session(peer_handle peer)
+{
+    auto slot = std::uint32_t(peer);
+
+    if (slot >= sessions_.size())
+        return nullptr;
+
+    auto &session = sessions_[slot];
+
+    if (!session.used || session.generation != std::uint32_t(peer >> 32))
+        return nullptr;
+
+    return &session;
+}
+
+peer_handle async_udp_listener::get_session(const sockaddr_storage &address, std::chrono::steady_clock::time_point now)
+{
+    auto slot = session_slots_.find(address);
+
+    if (slot != detail::address_map::npos)
+    {
+        sessions_[slot].last_activity = now;
+        return make_handle(slot, sessions_[slot].generation);
+    }
+
+    // Every datagram of a new sender would take memory otherwise, senders can be spoofed
+    if (session_slots_.size() >= max_sessions_)
+        return 0;
+
+    if (free_sessions_.empty())
+    {
+        slot = sessions_.size();
+        sessions_.emplace_back();
+    }
+    else
+    {
+        slot = free_sessions_.back();
+        free_sessions_.pop_back();
+    }
+
+    auto &session = sessions_[slot];
+
+    session.address = address;
+    session.last_activity = now;
+    session.used = true;
+
+    session_slots_.insert(address, slot);
+
+    return make_handle(slot, session.generation);
+}
+
+void async_udp_listener::process_datagram(peer_handle peer, const std::uint8_t *data, std::size_t length)
+{
+    // Packets never continue in the next datagram, a datagram may hold several of them though
+    while (length >= sizeof(packets::header))
+    {
+        // Copied out, packets following the first one aren't aligned
+        packets::header header = {};
+        memcpy(&header, data, sizeof(packets::header));
+
+        // The rest of the datagram can't be trusted either
+        if (header.magic != PACKET_MAGIC || header.length < sizeof(packets::header) || header.length > length)
+            return;
+
+        if (header.flags & packets::flags::fl_reliable)
+            process_reliable(peer, header, data, header.length);
+        else
+            deliver(peer, header, data + sizeof(packets::header), header.length - sizeof(packets::header));
+
+        data += header.length;
+        length -= header.length;
+    }
+}
+
+void async_udp_listener::process_reliable(peer_handle peer, const packets::header &header, const std::uint8_t *data, std::size_t length)
+{
+    if (length < sizeof(packets::header) + sizeof(packets::reliable_header))
+        return;
+
+    packets::reliable_header reliable_header = {};
+    memcpy(&reliable_header, data + sizeof(packets::header), sizeof(packets::reliable_header));
+
+    if (reliable_header.channel != std::uint8_t(delivery::reliable_unordered) && reliable_header.channel != std::uint8_t(delivery::reliable_ordered))
+        return;
+
+    auto slot = std::uint32_t(peer);
+    auto generation = std::uint32_t(peer >> 32);
+
+    if (slot >= reliability_.size())
+        reliability_.resize(slot + 1);
+
+    // The slot belonged to a session which expired, its sender starts over
+    if (reliability_[slot].generation != generation)
+    {
+        reliability_[slot] = {};
+        reliability_[slot].generation = generation;
+    }
+
+    auto &channel = reliability_[slot].channels[reliable_header.channel - 1];
+
+    std::uint16_t sequence = reliable_header.sequence;
+    auto result = channel.receiver.receive(sequence);
+
+    // Left unacknowledged, so the sender resends it once there's room for it
+    if (result == detail::reliable_receiver::result::dropped)
+        return;
+
+    if (channel.unacknowledged.empty())
+        pending_acks_.emplace_back(peer, reliable_header.channel);
+
+    channel.unacknowledged.push_back(sequence);
+
+    auto payload = data + sizeof(packets::header) + sizeof(packets::reliable_header);
+    auto payload_length = length - sizeof(packets::header) - sizeof(packets::reliable_header);
+
+    if (result == detail::reliable_receiver::result::early)
+    {
+        // Copied, the receive buffer is reused by the next batch
+        channel.receiver.hold(sequence, header, payload, payload_length);
+        return;
+    }
+
+    if (result == detail::reliable_receiver::result::duplicate)
+        return;
+
+    deliver(peer, header, payload, payload_length);
+
+    // Packets which arrived early may be due now
+    packets::header held_header = {};
+
+    while (channel.receiver.take_due(held_header, held_packet_))
+        deliver(peer, held_header, held_packet_.data(), held_packet_.size());
+}
+
+void async_udp_listener::deliver(peer_handle peer, const packets::header &header, const std::uint8_t *data, std::size_t length)
+{
+    if (header.id <= packets::ids::num_preset_ids)
+        return;
+
+    if (header.flags & packets::flags::fl_fragment)
+    {
+        if (length < sizeof(packets::fragment_header))
+            return;
 
-        std::lock_guard guard1(client_mtx_);
-        std::lock_guard guard2(process_mtx_);
+        packets::fragment_header fragment = {};
+        memcpy(&fragment, data, sizeof(packets::fragment_header));
 
-        // for (std::size_t i = 0; i < connected_clients_.size(); i++)
-        for (std::size_t i = 0; i < 1; i++)
+        auto result = reassembly_.add(peer, header.id, fragment, data + sizeof(packets::fragment_header),
+                                      length - sizeof(packets::fragment_header), batch_time_);
+
+        if (result != detail::reassembly_table::result::complete)
+            return;
+
+        auto &packet = reassembly_.get_completed();
+        serializer.borrow_buffer(packet.data(), packet.size());
+    }
+    else
+    {
+        // Read straight from the receive buffer, it isn't touched until we're done
+        serializer.borrow_buffer(data, length);
+    }
+
+    // Call the processing callback (it cannot be null)
+    process_callback_(this, peer, header.id, serializer);
+}
+
+void async_udp_listener::send_acks()
+{
+    if (pending_acks_.empty())
+        return;
+
+    constexpr std::size_t ack_length = sizeof(packets::header) + sizeof(packets::reliable_header);
+
+    auto count = pending_acks_.size();
+
+    ack_buffer_.resize(count * max_acks_ * ack_length);
+    ack_addresses_.resize(count);
+    ack_iovecs_.resize(count);
+    ack_messages_.resize(count);
+
+    {
+        std::lock_guard guard(session_mtx_);
+
+        // Sessions which expired in the meantime are left without an address
+        for (std::size_t i = 0; i < count; i++)
         {
-            // auto client = connected_clients_[i];
-            int client = 0;
-            auto &process_buffer = process_buffers_[client];
+            auto session = find_session(pending_acks_[i].first);
+            ack_addresses_[i] = session ? session->address : sockaddr_storage{};
+        }
+    }
+
+    std::size_t messages = 0;
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto [peer, channel_id] = pending_acks_[i];
+
+        auto &channel = reliability_[std::uint32_t(peer)].channels[channel_id - 1];
+        auto &sequences = channel.unacknowledged;
+
+        auto latest = channel.receiver.get_latest();
+
+        // Newest first, so each ack covers as many of the older ones as it can
+        std::sort(sequences.begin(), sequences.end(), [latest](std::uint16_t a, std::uint16_t b)
+                  { return std::uint16_t(latest - a) < std::uint16_t(latest - b); });
+
+        auto records = ack_buffer_.data() + i * max_acks_ * ack_length;
 
-            if (process_buffer.size() < sizeof(packets::header))
+        std::size_t acks = 0;
+        std::uint16_t anchor = 0;
+
+        for (auto sequence : sequences)
+        {
+            // Already covered by the bits of the last ack
+            if (acks && std::uint16_t(anchor - sequence) <= 32)
+                continue;
+
+            // Whatever doesn't fit is acknowledged once it is resent
+            if (acks == max_acks_)
+                break;
+
+            anchor = sequence;
+
+            auto header = construct_packet_header(sizeof(packets::reliable_header), packets::ids::id_none, packets::flags::fl_ack);
+
+            packets::reliable_header ack = {};
+
+            ack.channel = channel_id;
+            ack.ack = anchor;
+            ack.ack_bits = channel.receiver.get_ack_bits(anchor);
+
+            memcpy(records + acks * ack_length, &header, sizeof(packets::header));
+            memcpy(records + acks * ack_length + sizeof(packets::header), &ack, sizeof(packets::reliable_header));
+
+            acks++;
+        }
+
+        sequences.clear();
+
+        if (ack_addresses_[i].ss_family == AF_UNSPEC)
+            continue;
+
+        ack_iovecs_[i].iov_base = records;
+        ack_iovecs_[i].iov_len = acks * ack_length;
+
+        auto &message = ack_messages_[messages++];
+
+        message = {};
+        message.msg_hdr.msg_iov = &ack_iovecs_[i];
+        message.msg_hdr.msg_iovlen = 1;
+        message.msg_hdr.msg_name = &ack_addresses_[i];
+        message.msg_hdr.msg_namelen = ack_addresses_[i].ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    }
+
+    pending_acks_.clear();
+
+    // Acks which fail to go out are made up for by the sender resending its packets
+    std::size_t sent = 0;
+
+    while (sent < messages)
+    {
+        int result = sendmmsg(server_socket_, ack_messages_.data() + sent, messages - sent, 0);
+
+        if (result == -1)
+        {
+            if (errno == EINTR)
                 continue;
 
-            auto header = reinterpret_cast<packets::header *>(process_buffer.data());
+            break;
+        }
+
+        sent += result;
+    }
+}
+
+void async_udp_listener::expire_sessions()
+{
+    std::vector<peer_handle> expired = {};
+
+    {
+        std::lock_guard guard(session_mtx_);
 
-            bool is_disconnect_packet = header->id == packets::ids::id_disconnect && header->flags & packets::flags::fl_disconnect;
+        auto now = std::chrono::steady_clock::now();
 
-            // We have received a full packet
-            if (process_buffer.size() < header->length)
+        for (std::uint32_t slot = 0; slot < sessions_.size(); slot++)
+        {
+            auto &session = sessions_[slot];
+
+            if (!session.used || now - session.last_activity < session_timeout_)
                 continue;
 
-            auto data_start = process_buffer.data() + sizeof(packets::header);
-            std::uint32_t data_length = header->length - sizeof(packets::header);
+            expired.push_back(make_handle(slot, session.generation));
+
+            session_slots_.erase(session.address);
 
-            // Assign the data to our serializer
-            serializer.assign_buffer(data_start, data_length);
+            session.used = false;
 
-            // Call the processing callback (it cannot be null)
-            if (header->id > packets::ids::num_preset_ids)
-                process_callback_(this, client, header->id, serializer);
+            if (!++session.generation)
+                session.generation = 1;
 
-            // Erase the packet from our buffer (client might've disconnected during callback,
-            // therefore we need to check if the buffer still exists.
-            if (process_buffers_.find(client) != process_buffers_.end())
-                process_buffer.erase(process_buffer.begin(), process_buffer.begin() + data_length + sizeof(packets::header));
+            free_sessions_.push_back(slot);
         }
     }
+
+    // Called without holding the lock, so the callback may look up other sessions
+    if (on_expire_callback_)
+    {
+        for (auto peer : expired)
+            on_expire_callback_(this, peer);
+    }
 }
 
 void async_udp_listener::receive_data()
 {
-    std::vector<std::uint8_t> buffer(buffer_size_);
+    auto slot_size = receive_offload_ ? coalesced_buffer_size_ : buffer_size_;
+    auto slots = receive_offload_ ? coalesced_batch_size_ : batch_size_;
+
+    using segment_control = std::array<char, CMSG_SPACE(sizeof(int))>;
+
+    // Everything a batch is received into is set up once
+    std::vector<std::uint8_t> buffers(std::size_t(slots) * slot_size);
+
+    std::array<sockaddr_storage, batch_size_> addresses = {};
+    std::array<iovec, batch_size_> iovecs = {};
+    std::array<mmsghdr, batch_size_> messages = {};
+    std::array<segment_control, batch_size_> controls = {};
+    std::array<peer_handle, batch_size_> peers = {};
 
-    struct sockaddr from;
-    socklen_t fromlen = sizeof(from);
+    for (std::uint32_t i = 0; i < slots; i++)
+    {
+        iovecs[i].iov_base = buffers.data() + std::size_t(i) * slot_size;
+        iovecs[i].iov_len = slot_size;
+
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+    }
 
     while (running_)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        // Every receive overwrites these with the lengths of what it received
+        for (std::uint32_t i = 0; i < slots; i++)
+        {
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+
+            if (receive_offload_)
+            {
+                messages[i].msg_hdr.msg_control = controls[i].data();
+                messages[i].msg_hdr.msg_controllen = controls[i].size();
+            }
+        }
 
-        int bytes_received = recvfrom(server_socket_, reinterpret_cast<char *>(buffer.data()), buffer_size_, 0, &from, &fromlen);
+        // Waits for a datagram, then takes whatever else is queued already without waiting
+        int received = recvmmsg(server_socket_, messages.data(), slots, MSG_WAITFORONE, nullptr);
 
-        switch (bytes_received)
+        // Errors aren't tied to a sender, the socket being closed ends the loop
+        if (received <= 0)
+            continue;
+
+        // Look up the senders of the whole batch at once
         {
-        case -1:
-            // Disconnect the client on error
-            // We don't disconnect him on code 0 as that
-            // implies the client closed the connection by
-            // himself, which means it should've sent a
-            // disconnect packet.
-            // disconnect_client(client);
-            break;
-        case 0:
-            break;
-        default: // Received bytes, process them
+            std::lock_guard guard(session_mtx_);
 
-            std::lock_guard guard(process_mtx_);
-            int client = 0; // TODO: handle receiving from multiple sources
-            auto &process_buffer = process_buffers_[client];
-            process_buffer.insert(process_buffer.end(), buffer.begin(), buffer.begin() + bytes_received);
+            batch_time_ = std::chrono::steady_clock::now();
+
+            // Empty datagrams hold nothing to process, 0 is left for
+            // them as well as for new senders there's no room for.
+            for (int i = 0; i < received; i++)
+                peers[i] = messages[i].msg_len ? get_session(addresses[i], batch_time_) : 0;
         }
+
+        for (int i = 0; i < received; i++)
+        {
+            if (!peers[i])
+                continue;
+
+            auto data = static_cast<std::uint8_t *>(iovecs[i].iov_base);
+            std::size_t length = messages[i].msg_len;
+
+            // Coalesced datagrams come with the size they had, all but the last one are as large
+            std::size_t segment_size = length;
+
+            for (auto control = CMSG_FIRSTHDR(&messages[i].msg_hdr); control; control = CMSG_NXTHDR(&messages[i].msg_hdr, control))
+            {
+                if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+                {
+                    int size = 0;
+                    memcpy(&size, CMSG_DATA(control), sizeof(size));
+
+                    if (size > 0)
+                        segment_size = size;
+                }
+            }
+
+            for (std::size_t offset = 0; offset < length; offset += segment_size)
+                process_datagram(peers[i], data + offset, std::min(segment_size, length - offset));
+        }
+
+        send_acks();
+
+        // Packets still missing fragments give their memory back once they timed out
+        reassembly_.expire(batch_time_);
     }
 }
 
-void async_udp_listener::run_heartbeat()
+void async_udp_listener::run_expiry()
 {
-    // no need to check if connection holds in UDP
+    if (session_timeout_.count() == 0)
+        return;
+
+    // Sessions expire at most a quarter of the timeout late
+    auto interval = std::clamp<std::chrono::milliseconds>(session_timeout_ / 4, std::chrono::milliseconds(10), std::chrono::seconds(1));
+
+    std::unique_lock lock(expiry_mtx_);
+
+    while (running_)
+    {
+        if (expiry_cv_.wait_for(lock, interval, [this]
+                                { return !running_; }))
+            break;
+
+        expire_sessions();
+    }
 }
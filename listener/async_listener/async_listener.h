@@ -19,6 +19,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 
 #else
 #error OS unknown or not supported.
@@ -30,13 +31,24 @@
 #include <unordered_map>
 #include <mutex>
 #include <functional>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 
+#include "../../shared/address_map/address_map.h"
 #include "../../shared/packets/packets.h"
+#include "../../shared/reassembly/reassembly.h"
+#include "../../shared/reliability/reliability.h"
 
 namespace fi
 {
     using SOCKET = int;
 
+    // Identifies a sender for as long as its session lasts. Handles of expired
+    // sessions stay invalid, even once their sender comes back. 0 is never a handle.
+    using peer_handle = std::uint64_t;
+
     class async_udp_listener
     {
     public:
@@ -48,48 +60,155 @@ namespace fi
 
         bool is_running();
 
-        // The callback will be called once a packet is received. You must register
-        // your callback before you start the server, as not doing so will result
-        // in an exception.
-        void register_callback(std::function<void(async_udp_listener *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn);
+        // The callback will be called once a packet is received, with the session of its
+        // sender. Packets the talker sent reliably are acknowledged and handed over once,
+        // those of ordered channels in the order they were sent in. You must register your
+        // callback before you start the server, as not doing so will result in an exception.
+        void register_callback(std::function<void(async_udp_listener *const, const peer_handle, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn);
 
         // This function will be called as soon as the server stops.
         void register_stop_callback(std::function<void(async_udp_listener *const)> callback_fn);
 
+        // Called once the session of a sender expired, as it didn't send anything for the session timeout
+        void register_expire_callback(std::function<void(async_udp_listener *const, const peer_handle)> callback_fn);
+
+        // Sessions of senders which didn't send anything for this long expire (default 30
+        // seconds), 0 keeps them forever. Must be called before starting the listener.
+        void set_session_timeout(std::chrono::milliseconds timeout);
+
+        // Datagrams of new senders are dropped while there are this many sessions (default 4096).
+        // Must be called before starting the listener.
+        void set_max_sessions(std::size_t max_sessions);
+
+        // Packets the talker split into fragments are put back together in up to max_memory bytes
+        // (default 16 MiB), each up to max_packet_length bytes long (default 1 MiB). Those still
+        // missing fragments after the timeout (default 1 second) are dropped. Must be called
+        // before starting the listener.
+        void set_reassembly_limits(std::size_t max_packet_length, std::size_t max_memory, std::chrono::milliseconds timeout);
+
+        // Returns false if the session expired
+        bool get_peer_address(peer_handle peer, sockaddr_storage &address);
+
+        // Whether the kernel coalesces datagrams of a sender, which are split up again
+        // by the listener. Used where the kernel supports it, known once started.
+        bool has_receive_offload();
+
     private:
+        struct session
+        {
+            sockaddr_storage address = {};
+            std::chrono::steady_clock::time_point last_activity = {};
+
+            // Bumped once the session expires, which invalidates its handles
+            std::uint32_t generation = 1;
+            bool used = false;
+        };
+
+        struct reliable_channel
+        {
+            detail::reliable_receiver receiver;
+
+            // Sequences received during the current batch, acknowledged once it's processed
+            std::vector<std::uint16_t> unacknowledged = {};
+        };
+
+        // Only touched by the receiving thread, reset once the generation of its session changed
+        struct session_reliability
+        {
+            std::uint32_t generation = 0;
+
+            // Indexed by the delivery - 1
+            std::array<reliable_channel, 2> channels = {
+                reliable_channel{detail::reliable_receiver(false)},
+                reliable_channel{detail::reliable_receiver(true)}};
+        };
+
         packets::header construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags);
 
+        // Handles hold the slot of the session in the lower and its generation in the upper half
+        peer_handle make_handle(std::uint32_t slot, std::uint32_t generation);
+        session *find_session(peer_handle peer);
+
+        // Finds the session of the sender or starts one, returns 0 if there's no room for it
+        peer_handle get_session(const sockaddr_storage &address, std::chrono::steady_clock::time_point now);
+
+        void process_datagram(peer_handle peer, const std::uint8_t *data, std::size_t length);
+        void process_reliable(peer_handle peer, const packets::header &header, const std::uint8_t *data, std::size_t length);
+
+        // Hands a packet over to the callback, the data follows its headers. Fragments
+        // are put together first, the callback gets the packet once it's complete.
+        void deliver(peer_handle peer, const packets::header &header, const std::uint8_t *data, std::size_t length);
+
+        // Sends the acks for every reliable packet received during the batch
+        void send_acks();
+        void expire_sessions();
+
         // These functions are running in a thread
-        void process_data();
         void receive_data();
-        void run_heartbeat();
+        void run_expiry();
 
-        bool running_ = false;
+        std::atomic<bool> running_ = false;
 
-        // This specifies the buffer size when receiving data.
-        // It does not affect the size of the processing queue.
+        // This specifies the buffer size when receiving data,
+        // datagrams are processed straight from the buffer.
         const std::uint32_t buffer_size_ = PACKET_BUFFER_SIZE;
 
-        // The amount of time to wait between heartbeat packets
-        const std::chrono::duration<long long> heartbeat_interval_ = std::chrono::seconds(5);
+        // Datagrams taken from the socket with a single call, each gets a buffer of its own
+        static constexpr std::uint32_t batch_size_ = 64;
+
+        // With receive offload the kernel hands us datagrams of a sender coalesced into
+        // buffers of up to 64 KiB, which are fewer but need larger buffers.
+        static constexpr std::uint32_t coalesced_buffer_size_ = 65535;
+        static constexpr std::uint32_t coalesced_batch_size_ = 16;
+
+        // Whether the socket takes coalesced datagrams (UDP_GRO, Linux 5.0+), checked by start
+        bool receive_offload_ = false;
 
         SOCKET server_socket_ = 0;
 
         std::mutex send_mtx_ = {}, disconnect_mtx_ = {};
 
-        // These CAN be accessed in the same thread multiple times, therefore we
-        // need to make these recursive.
-        std::recursive_mutex client_mtx_ = {}, process_mtx_ = {};
+        // Sessions live in slots which are reused once they expired, the map finds the slot of a sender
+        std::mutex session_mtx_ = {};
+        std::vector<session> sessions_ = {};
+        std::vector<std::uint32_t> free_sessions_ = {};
+        detail::address_map session_slots_ = {};
+
+        // Indexed by the slot of the session
+        std::vector<session_reliability> reliability_ = {};
+
+        // The channels which received reliable packets during the current batch,
+        // and what the acks sent for them are set up in. Reused by every batch.
+        std::vector<std::pair<peer_handle, std::uint8_t>> pending_acks_ = {};
+        std::vector<std::uint8_t> ack_buffer_ = {};
+        std::vector<sockaddr_storage> ack_addresses_ = {};
+        std::vector<iovec> ack_iovecs_ = {};
+        std::vector<mmsghdr> ack_messages_ = {};
+
+        // Packets held by ordered channels are taken into this once due
+        detail::pooled_bytes held_packet_ = {};
+
+        // Only touched by the receiving thread, as is the time the current batch was received at
+        detail::reassembly_table reassembly_ = {};
+        std::chrono::steady_clock::time_point batch_time_ = {};
+
+        // Acks a single datagram holds at most, each covers 33 sequences
+        static constexpr std::size_t max_acks_ = 64;
+
+        std::chrono::milliseconds session_timeout_ = std::chrono::seconds(30);
+        std::size_t max_sessions_ = 4096;
 
-        std::vector<SOCKET> connected_clients_ = {};
-        std::unordered_map<SOCKET, std::vector<std::uint8_t>> process_buffers_ = {};
+        // Wakes the expiry thread up once the listener stops
+        std::mutex expiry_mtx_ = {};
+        std::condition_variable expiry_cv_ = {};
 
         std::function<void(async_udp_listener *const)> on_stop_callback_ = {};
+        std::function<void(async_udp_listener *const, const peer_handle)> on_expire_callback_ = {};
 
         // Our main processing callback
-        std::function<void(async_udp_listener *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> process_callback_ = {};
+        std::function<void(async_udp_listener *const, const peer_handle, const packets::packet_id, packets::detail::binary_serializer &)> process_callback_ = {};
 
-        std::thread accepting_thread_ = {}, processing_thread_ = {}, receiving_thread_ = {}, heartbeat_thread_{};
+        std::thread accepting_thread_ = {}, receiving_thread_ = {}, expiry_thread_{};
 
         // This will help us in serializing our packet data
         packets::detail::binary_serializer serializer = {};
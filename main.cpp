@@ -9,13 +9,10 @@
 
 using SOCKET = int;
 
-#define sPROCESS_PACKET_FN(ID, name) void name(fi::async_tcp_server *const sv, const SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
-
-sPROCESS_PACKET_FN(fi::packets::id_example, s_on_example_packet)
+// Registered with server.on, the server deserializes the packet for us and
+// disconnects clients sending packets which don't hold what they claim to
+void s_on_example_packet(fi::async_tcp_server *const sv, const fi::client_handle from, fi::packets::example_packet &example)
 {
-    // Read our packet
-    fi::packets::example_packet example(s);
-
     // Now we can access our data
     for (std::size_t i = 0; i < example.some_string_array.size(); i++)
         printf("[ %i ] %s\n", i, example.some_string_array[i].data());
@@ -26,12 +23,9 @@ sPROCESS_PACKET_FN(fi::packets::id_example, s_on_example_packet)
     sv->send_packet(from, &example);
 }
 
-#define cPROCESS_PACKET_FN(ID, name) void name(fi::async_tcp_client *const cl, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
-
-cPROCESS_PACKET_FN(fi::packets::id_example, c_on_example_packet)
+// The client's packets are decoded by a packet_table, the handlers get them ready to use
+void c_on_example_packet(fi::async_tcp_client *const cl, fi::packets::example_packet &example)
 {
-    fi::packets::example_packet example(s);
-
     // Now we can access our data
     for (std::size_t i = 0; i < example.some_string_array.size(); i++)
         printf("[ %i ] %s\n", i, example.some_string_array[i].data());
@@ -40,12 +34,16 @@ cPROCESS_PACKET_FN(fi::packets::id_example, c_on_example_packet)
     cl->disconnect();
 }
 
-#define lPROCESS_PACKET_FN(ID, name) void name(fi::async_udp_listener *const sv, const SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
+#define lPROCESS_PACKET_FN(ID, name) void name(fi::async_udp_listener *const sv, const fi::peer_handle from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
 
 lPROCESS_PACKET_FN(fi::packets::id_example, l_on_example_packet)
 {
-    // Read our packet
-    fi::packets::example_packet example(s);
+    // Read our packet into the same instance every time, it keeps its memory that way
+    thread_local fi::packets::example_packet example = {};
+    example.read(s);
+
+    if (s.has_failed())
+        return;
 
     // Now we can access our data
     for (std::size_t i = 0; i < example.some_string_array.size(); i++)
@@ -61,12 +59,12 @@ int main_server()
         fi::async_tcp_server server = {};
 
         // Setup all our callbacks before starting the server
-        server.register_connect_callback([](fi::async_tcp_server *const sv, SOCKET who)
-                                         { printf("Client with socket ID %i has connected.\n", who); });
+        server.register_connect_callback([](fi::async_tcp_server *const sv, fi::client_handle who)
+                                         { printf("Client with handle %llx has connected.\n", (unsigned long long)who); });
 
-        server.register_disconnect_callback([](fi::async_tcp_server *const sv, SOCKET who)
+        server.register_disconnect_callback([](fi::async_tcp_server *const sv, fi::client_handle who)
                                             {
-			printf( "Client with socket ID %i has disconnected.\n", who );
+			printf( "Client with handle %llx has disconnected.\n", (unsigned long long)who );
 			
 			// Stop the server as we're done communicating
 			sv->stop( ); });
@@ -74,16 +72,12 @@ int main_server()
         server.register_stop_callback([](fi::async_tcp_server *const sv)
                                       { printf("Server has been stopped.\n"); });
 
-        server.register_callback([](fi::async_tcp_server *const sv, SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
-                                 {
-			// You can use a switch case, an unordered map, an array.. whichever suits you best
-			switch ( id ) {
-				case fi::packets::id_example:
-					s_on_example_packet( sv, from, id, s );
-					break;
-				default:
-					printf( "Unknown packet ID %i received\n", id );
-			} });
+        // Every packet type gets a handler of its own
+        server.on<fi::packets::example_packet>(s_on_example_packet);
+
+        // Called for packets without a handler
+        server.register_callback([](fi::async_tcp_server *const sv, fi::client_handle from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
+                                 { printf("Unknown packet ID %i received\n", id); });
 
         // Attempt to start the server
         server.start("1337");
@@ -115,16 +109,18 @@ int main_client()
         client.register_disconnect_callback([](fi::async_tcp_client *const cl)
                                             { printf("Disconnected from server.\n"); });
 
-        client.register_callback([](fi::async_tcp_client *const cl, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
+        // The table mapping ids to packets is built at compile time
+        using client_packets = fi::packets::packet_table<fi::packets::example_packet>;
+
+        // The packets are decoded into the same instances every time
+        client.register_callback([packets = client_packets::instances()](fi::async_tcp_client *const cl, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s) mutable
                                  {
-			// You can use a switch case, an unordered map, an array.. whichever suits you best
-			switch ( id ) {
-				case fi::packets::id_example:
-					c_on_example_packet( cl, id, s );
-					break;
-				default:
-					printf( "Unknown packet ID %i received\n", id );
-			} });
+			bool handled = client_packets::dispatch( id, s, packets, [ cl ]( fi::packets::example_packet &example ) {
+				c_on_example_packet( cl, example );
+			} );
+
+			if ( !handled )
+				printf( "Unknown or malformed packet ID %i received\n", id ); });
 
         if (client.connect("localhost", "1337"))
         {
@@ -170,7 +166,11 @@ int main_listener()
         listener.register_stop_callback([](fi::async_udp_listener *const sv)
                                         { printf("Listener has been stopped.\n"); });
 
-        listener.register_callback([](fi::async_udp_listener *const sv, SOCKET from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
+        // Every talker gets a session of its own, which expires once it stopped sending
+        listener.register_expire_callback([](fi::async_udp_listener *const sv, fi::peer_handle who)
+                                          { printf("Session of peer %llx has expired.\n", (unsigned long long)who); });
+
+        listener.register_callback([](fi::async_udp_listener *const sv, fi::peer_handle from, const fi::packets::packet_id id, fi::packets::detail::binary_serializer &s)
                                    {
 			// You can use a switch case, an unordered map, an array.. whichever suits you best
 			switch ( id ) {
@@ -2,9 +2,6 @@
 
 using namespace fi;
 
-// TODO:
-// -add handshake timeout
-// -finish processing all packets before we exit thread( cba rn, but its ez.look @ client )
 async_tcp_server::async_tcp_server()
 {
 #ifdef _WIN32
@@ -20,27 +17,37 @@ async_tcp_server::~async_tcp_server()
 	if (accepting_thread_.joinable())
 		accepting_thread_.join();
 
-	if (processing_thread_.joinable())
-		processing_thread_.join();
+	for (auto &loop : event_loops_)
+	{
+		if (loop->thread.joinable())
+			loop->thread.join();
+
+		if (loop->epoll_fd != -1)
+			close(loop->epoll_fd);
 
-	if (receiving_thread_.joinable())
-		receiving_thread_.join();
+		if (loop->wakeup_fd != -1)
+			close(loop->wakeup_fd);
+	}
 
-	if (heartbeat_thread_.joinable())
-		heartbeat_thread_.join();
+	// The loops are gone, finish the callbacks they handed to the workers
+	workers_.stop();
 
 #ifdef _WIN32
 	WSACleanup();
 #endif // _WIN32
 }
 
-void async_tcp_server::start(std::string_view port)
+void async_tcp_server::start(std::string_view port, std::size_t thread_count)
 {
 	if (running_)
 		throw exception(exception::reason_id::already_running, "async_tcp_server::start: attempted to start server while it was running");
 
-	if (!process_callback_)
-		throw exception(exception::reason_id::no_callback, "async_tcp_server::start: no processing callback set");
+	if (handlers_.empty())
+		throw exception(exception::reason_id::no_callback, "async_tcp_server::start: no processing callback or handler set");
+
+	// The loop index is part of the client handles
+	if (thread_count == 0 || thread_count > max_event_loops_)
+		throw exception(exception::reason_id::invalid_thread_count, "async_tcp_server::start: between 1 and 256 event loop threads are supported");
 
 	addrinfo hints = {}, *result = nullptr;
 
@@ -72,14 +79,55 @@ void async_tcp_server::start(std::string_view port)
 		throw exception(exception::reason_id::listen_error, "async_tcp_server::start: failed to listen on socket");
 	}
 
+	// Lets the accepting thread empty the backlog until it hits EAGAIN
+	if (!set_non_blocking(server_socket_))
+	{
+		freeaddrinfo(result);
+		throw exception(exception::reason_id::socket_failure, "async_tcp_server::start: failed to make the socket non-blocking");
+	}
+
 	freeaddrinfo(result);
 
+	// Set up the event loops, each one gets its own epoll instance
+	event_loops_.clear();
+	for (std::size_t i = 0; i < thread_count; i++)
+	{
+		auto loop = std::make_unique<event_loop>();
+
+		loop->index = std::uint8_t(i);
+		loop->epoll_fd = epoll_create1(0);
+		loop->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+
+		epoll_event wakeup_event = {};
+		wakeup_event.events = EPOLLIN;
+		wakeup_event.data.u64 = wakeup_completion_;
+
+		bool failed = loop->epoll_fd == -1 || loop->wakeup_fd == -1 ||
+					  epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &wakeup_event) == -1;
+
+		event_loops_.push_back(std::move(loop));
+
+		if (failed)
+			throw exception(exception::reason_id::epoll_failure, "async_tcp_server::start: failed to create epoll instance");
+	}
+
+	auto header = construct_packet_header(0, packets::ids::id_heartbeat, packets::flags::fl_heartbeat);
+	auto header_data = reinterpret_cast<std::uint8_t *>(&header);
+	heartbeat_packet_ = std::allocate_shared<const detail::pooled_bytes>(detail::pool_allocator<detail::pooled_bytes>(), header_data, header_data + sizeof(header));
+
+	// Our header with no body and the handshake_sv flag
+	header = construct_packet_header(0, packets::ids::id_handshake, packets::flags::fl_handshake_sv);
+	handshake_packet_ = std::allocate_shared<const detail::pooled_bytes>(detail::pool_allocator<detail::pooled_bytes>(), header_data, header_data + sizeof(header));
+
 	running_ = true;
 
+	if (worker_count_)
+		workers_.start(worker_count_);
+
+	for (auto &loop : event_loops_)
+		loop->thread = std::thread(&async_tcp_server::run_event_loop, this, loop.get());
+
 	accepting_thread_ = std::thread(&async_tcp_server::accept_clients, this);
-	processing_thread_ = std::thread(&async_tcp_server::process_data, this);
-	receiving_thread_ = std::thread(&async_tcp_server::receive_data, this);
-	heartbeat_thread_ = std::thread(&async_tcp_server::run_heartbeat, this);
 }
 
 void async_tcp_server::stop()
@@ -92,35 +140,31 @@ void async_tcp_server::stop()
 		// closesocket(server_socket_);
 		close(server_socket_);
 
+		// Wake up the event loops so they notice we stopped,
+		// they will disconnect their clients before exiting.
+		for (auto &loop : event_loops_)
+			wake_loop(*loop);
+
 		if (on_stop_callback_)
 			on_stop_callback_(this);
 	}
-
-	connected_clients_.clear();
-	process_buffers_.clear();
-	clients_to_disconnect_.clear();
 }
 
-void async_tcp_server::disconnect_client(SOCKET who)
+void async_tcp_server::disconnect_client(client_handle who)
 {
-	std::lock_guard guard1(client_mtx_);
-	std::lock_guard guard2(process_mtx_);
+	auto loop = find_loop(who);
 
-	auto it = std::find_if(connected_clients_.begin(), connected_clients_.end(), [&who](const SOCKET &s)
-						   { return s == who; });
-
-	if (it == connected_clients_.end())
+	if (!loop)
 		return;
 
-	shutdown(who, 2);
-	// closesocket(who);
-	close(who);
-
-	process_buffers_.erase(who);
-	connected_clients_.erase(it);
+	if (std::this_thread::get_id() == loop->thread.get_id())
+	{
+		disconnect_client_internal(*loop, who);
+		return;
+	}
 
-	if (on_disconnect_callback_)
-		on_disconnect_callback_(this, who);
+	// The client belongs to another thread, let its loop drop it
+	queue_disconnect(*loop, who);
 }
 
 bool async_tcp_server::is_running()
@@ -128,46 +172,83 @@ bool async_tcp_server::is_running()
 	return running_;
 }
 
-void async_tcp_server::send_packet(SOCKET to, packets::base_packet *packet)
+async_tcp_server::send_result async_tcp_server::send_packet(client_handle to, packets::base_packet *packet)
 {
 	if (!packet)
 		throw exception(exception::reason_id::packet_nullptr, "async_tcp_server::send_packet: packet was nullptr");
 
-	std::lock_guard guard(send_mtx_);
+	auto loop = find_loop(to);
 
-	serializer.reset();
+	if (!loop)
+		return send_result::not_connected;
 
-	// Serialize our data
-	packet->serialize(serializer);
+	return queue_packet(*loop, to, serialize_packet(packet));
+}
+
+std::size_t async_tcp_server::broadcast(packets::base_packet *packet)
+{
+	if (!packet)
+		throw exception(exception::reason_id::packet_nullptr, "async_tcp_server::broadcast: packet was nullptr");
 
-	// Allocate a buffer for our packet
-	std::vector<std::uint8_t> packet_data(sizeof(packets::header) + serializer.get_serialized_data_length());
+	auto packet_data = serialize_packet(packet);
+	std::size_t queued = 0;
 
-	// Construct our packet header
-	packets::header packet_header = construct_packet_header(
-		serializer.get_serialized_data_length(),
-		packet->get_id(),
-		packets::flags::fl_none);
+	for (auto &loop : event_loops_)
+	{
+		std::lock_guard guard(loop->client_mtx);
+
+		for (std::uint32_t slot = 0; slot < loop->connections.size(); slot++)
+		{
+			auto &client = loop->connections[slot];
+
+			if (client.state != connection_state::established)
+				continue;
+
+			if (queue_packet(*loop, make_handle(*loop, slot, client.generation), packet_data) != send_result::not_connected)
+				queued++;
+		}
+	}
+
+	return queued;
+}
 
-	// Write our packet into the buffer
-	memcpy(packet_data.data(), &packet_header, sizeof(packets::header));
+std::size_t async_tcp_server::send_to_many(std::span<const client_handle> to, packets::base_packet *packet)
+{
+	if (!packet)
+		throw exception(exception::reason_id::packet_nullptr, "async_tcp_server::send_to_many: packet was nullptr");
+
+	auto packet_data = serialize_packet(packet);
+	std::size_t queued = 0;
+
+	// Every loop is locked once, it picks out the clients it owns
+	for (auto &loop : event_loops_)
+	{
+		std::lock_guard guard(loop->client_mtx);
+
+		for (auto client : to)
+		{
+			if (find_loop(client) != loop.get())
+				continue;
 
-	memcpy(
-		packet_data.data() + sizeof(packets::header),
-		serializer.get_serialized_data(),
-		serializer.get_serialized_data_length());
+			if (queue_packet(*loop, client, packet_data) != send_result::not_connected)
+				queued++;
+		}
+	}
 
-	// Attempt to send the packet
-	if (!send_packet_internal(to, packet_data.data(), packet_data.size()))
-		disconnect_client(to);
+	return queued;
 }
 
-void async_tcp_server::register_callback(std::function<void(async_tcp_server *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn)
+void async_tcp_server::register_callback(std::function<void(async_tcp_server *const, const client_handle, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn)
 {
 	if (!callback_fn)
 		throw exception(exception::reason_id::null_callback, "async_tcp_server::register_callback: no callback given");
 
-	process_callback_ = callback_fn;
+	handlers_.set_fallback(callback_fn);
+}
+
+detail::packet_stats async_tcp_server::get_packet_stats(packets::packet_id id)
+{
+	return handlers_.get_stats(id);
 }
 
 void async_tcp_server::register_stop_callback(std::function<void(async_tcp_server *const)> callback_fn)
@@ -175,16 +256,96 @@ void async_tcp_server::register_stop_callback(std::function<void(async_tcp_serve
 	on_stop_callback_ = callback_fn;
 }
 
-void async_tcp_server::register_connect_callback(std::function<void(async_tcp_server *const, const SOCKET)> callback_fn)
+void async_tcp_server::register_connect_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn)
 {
 	on_connect_callback = callback_fn;
 }
 
-void async_tcp_server::register_disconnect_callback(std::function<void(async_tcp_server *const, const SOCKET)> callback_fn)
+void async_tcp_server::register_disconnect_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn)
 {
 	on_disconnect_callback_ = callback_fn;
 }
 
+void async_tcp_server::register_drain_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn)
+{
+	on_drain_callback_ = callback_fn;
+}
+
+void async_tcp_server::set_processing_budget(std::uint32_t packets_per_client)
+{
+	if (!packets_per_client)
+		throw exception(exception::reason_id::invalid_budget, "async_tcp_server::set_processing_budget: the budget must allow at least one packet");
+
+	processing_budget_ = packets_per_client;
+}
+
+void async_tcp_server::set_worker_count(std::size_t worker_count)
+{
+	if (running_)
+		throw exception(exception::reason_id::already_running, "async_tcp_server::set_worker_count: attempted to change the worker count while running");
+
+	worker_count_ = worker_count;
+}
+
+void async_tcp_server::set_io_backend(io_backend backend)
+{
+	if (running_)
+		throw exception(exception::reason_id::already_running, "async_tcp_server::set_io_backend: attempted to change the backend while running");
+
+	backend_ = backend;
+}
+
+void async_tcp_server::set_send_watermarks(std::size_t low, std::size_t high)
+{
+	if (running_)
+		throw exception(exception::reason_id::already_running, "async_tcp_server::set_send_watermarks: attempted to change the watermarks while running");
+
+	if (!high || low > high)
+		throw exception(exception::reason_id::invalid_watermarks, "async_tcp_server::set_send_watermarks: the low watermark must not exceed the high one");
+
+	send_low_watermark_ = low;
+	send_high_watermark_ = high;
+}
+
+void async_tcp_server::set_idle_timeout(std::chrono::milliseconds timeout)
+{
+	if (running_)
+		throw exception(exception::reason_id::already_running, "async_tcp_server::set_idle_timeout: attempted to change the idle timeout while running");
+
+	idle_timeout_ = timeout;
+}
+
+async_tcp_server::timer_id async_tcp_server::schedule_timer(std::chrono::milliseconds delay, std::function<void(async_tcp_server *const)> callback)
+{
+	if (!callback)
+		throw exception(exception::reason_id::null_callback, "async_tcp_server::schedule_timer: no callback given");
+
+	if (!running_)
+		throw exception(exception::reason_id::not_running, "async_tcp_server::schedule_timer: attempted to schedule a timer while not running");
+
+	timer_id id = next_timer_id_++;
+	auto &loop = *event_loops_[id % event_loops_.size()];
+
+	// The deadline is fixed now, not once the loop gets to it
+	std::lock_guard guard(loop.client_mtx);
+	loop.timers_to_schedule.push_back({id, detail::timer_wheel::clock::now() + delay, std::move(callback)});
+	wake_loop(loop);
+
+	return id;
+}
+
+void async_tcp_server::cancel_timer(timer_id id)
+{
+	if (!running_ || !id)
+		return;
+
+	auto &loop = *event_loops_[id % event_loops_.size()];
+
+	std::lock_guard guard(loop.client_mtx);
+	loop.timers_to_cancel.push_back(id);
+	wake_loop(loop);
+}
+
 packets::header async_tcp_server::construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags)
 {
 	packets::header packet_header = {};
@@ -197,222 +358,1135 @@ packets::header async_tcp_server::construct_packet_header(packets::packet_length
 	return packet_header;
 }
 
-bool async_tcp_server::perform_handshake(SOCKET with)
+async_tcp_server::shared_buffer async_tcp_server::serialize_packet(packets::base_packet *packet)
 {
-	packets::header packet_header = construct_packet_header(0, packets::ids::id_handshake, packets::flags::fl_handshake_sv);
+	// Every thread serializes with its own serializer so
+	// sends to clients of different loops don't contend.
+	thread_local packets::detail::binary_serializer serializer = {};
 
-	auto buffer = reinterpret_cast<char *>(&packet_header);
+	// Leave room for the header, the serialized buffer is the packet as it goes out
+	serializer.reserve_header(sizeof(packets::header));
 
-	// Send our header with no body and the handshake_sv flag
-	if (!send_packet_internal(with, &packet_header, sizeof(packets::header)))
-		return false;
+	// Serialize our data
+	packet->serialize(serializer);
 
-	// Receive a response back. Should be the header with handshake_cl flag
-	int bytes_received = 0;
-	do
-	{
-		int received = recv(with, buffer + bytes_received, sizeof(packets::header) - bytes_received, 0);
+	// Construct our packet header
+	packets::header packet_header = construct_packet_header(
+		serializer.get_serialized_data_length(),
+		packet->get_id(),
+		packets::flags::fl_none);
 
-		if (received <= 0)
-			return false;
+	serializer.write_header(packet_header);
 
-		bytes_received += received;
-	} while (bytes_received < sizeof(packets::header));
+	// The send queues take the buffer over without copying it
+	return std::allocate_shared<const detail::pooled_bytes>(detail::pool_allocator<detail::pooled_bytes>(), serializer.take_frame());
+}
 
-	// Check the header information for the information we are expecting
-	if (packet_header.flags != packets::flags::fl_handshake_cl)
-		return false;
+async_tcp_server::send_result async_tcp_server::queue_packet(event_loop &loop, client_handle to, shared_buffer data)
+{
+	// Holding the lock of the owning loop keeps the socket from being closed
+	// (and reused) while we write and keeps packets from interleaving.
+	std::lock_guard guard(loop.client_mtx);
 
-	if (packet_header.id != packets::ids::id_handshake)
-		return false;
+	// The client might've been disconnected in the meantime,
+	// clients still handshaking can't be sent to either.
+	auto client = find_connection(loop, to);
 
-	if (packet_header.length != sizeof(packets::header))
-		return false;
+	if (!client || client->state != connection_state::established)
+		return send_result::not_connected;
 
-	if (packet_header.magic != PACKET_MAGIC)
-		return false;
+	auto &queue = client->queue;
+	bool was_empty = queue.packets.empty();
 
-	return true;
+	queue.queued_bytes += data->size();
+	queue.packets.push_back(std::move(data));
+
+	// A non-empty queue is already taken care of by the loop. Otherwise we
+	// attempt to write right away and only leave the rest to the loop.
+	// Loops running io_uring submit every send themselves.
+#ifdef FI_HAS_IO_URING
+	bool write_now = !loop.uses_ring;
+#else
+	bool write_now = true;
+#endif // FI_HAS_IO_URING
+
+	if (was_empty)
+	{
+		if (write_now && !flush_client(client->socket, queue))
+		{
+			queue_disconnect(loop, to);
+			return send_result::not_connected;
+		}
+
+		if (!queue.packets.empty())
+		{
+			if (std::this_thread::get_id() == loop.thread.get_id())
+				watch_writable(loop, to, *client);
+			else
+			{
+				// One wakeup covers every client handed over until the loop picks them up
+				if (loop.clients_to_flush.empty())
+					wake_loop(loop);
+
+				loop.clients_to_flush.push_back(to);
+			}
+		}
+	}
+
+	if (queue.queued_bytes > send_high_watermark_)
+		queue.congested = true;
+
+	return queue.congested ? send_result::backpressure : send_result::ok;
 }
 
-bool async_tcp_server::send_packet_internal(SOCKET to, void *const data, const packets::packet_length length)
+bool async_tcp_server::flush_client(SOCKET client, send_queue &queue)
 {
-	std::uint32_t bytes_sent = 0;
-	do
+	iovec iovecs[max_iovecs_] = {};
+
+	while (!queue.packets.empty())
 	{
-		int sent = send(
-			to,
-			reinterpret_cast<char *>(data) + bytes_sent,
-			length - bytes_sent,
-			0);
+		// Works like writev, but a client which went away must not raise SIGPIPE
+		msghdr message = {};
+		message.msg_iov = iovecs;
+		message.msg_iovlen = gather_packets(queue, iovecs);
+
+		auto sent = sendmsg(client, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (sent == -1)
+		{
+			// The socket is full, the loop carries on once it is writable again
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			if (errno == EINTR)
+				continue;
 
-		if (sent <= 0)
 			return false;
+		}
 
-		bytes_sent += sent;
-	} while (bytes_sent < length);
+		pop_written(queue, sent);
+	}
 
 	return true;
 }
 
-void async_tcp_server::accept_clients()
+std::size_t async_tcp_server::gather_packets(const send_queue &queue, iovec *iovecs)
 {
-	while (running_)
+	// Gather as many queued packets as we can into a single call
+	std::size_t count = 0;
+
+	for (auto it = queue.packets.begin(); it != queue.packets.end() && count < max_iovecs_; it++, count++)
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		std::size_t offset = count ? 0 : queue.front_offset;
 
-		auto client = accept(server_socket_, nullptr, nullptr);
+		// The buffer is never written to, sendmsg merely lacks the const
+		iovecs[count].iov_base = const_cast<std::uint8_t *>((*it)->data()) + offset;
+		iovecs[count].iov_len = (*it)->size() - offset;
+	}
 
-		if (client == -1)
-			continue;
+	return count;
+}
 
-		// Attempt to handshake with the client,
-		// disconnect from it upon failure.
-		if (!perform_handshake(client))
+void async_tcp_server::pop_written(send_queue &queue, std::size_t written)
+{
+	queue.queued_bytes -= written;
+
+	// Drop every packet which was written completely
+	while (written > 0)
+	{
+		std::size_t remaining = queue.packets.front()->size() - queue.front_offset;
+
+		if (written < remaining)
 		{
-			shutdown(client, 2);
-			// closesocket(client);
-			close(client);
-			continue;
+			queue.front_offset += written;
+			break;
 		}
 
-		std::lock_guard guard(client_mtx_);
-		connected_clients_.push_back(client);
+		written -= remaining;
+		queue.packets.pop_front();
+		queue.front_offset = 0;
+	}
+}
 
-		if (!on_connect_callback)
-			continue;
+bool async_tcp_server::set_non_blocking(SOCKET s)
+{
+	int flags = fcntl(s, F_GETFL, 0);
 
-		on_connect_callback(this, client);
-	}
+	if (flags == -1)
+		return false;
+
+	return fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1;
 }
 
-void async_tcp_server::process_data()
+client_handle async_tcp_server::make_handle(const event_loop &loop, std::uint32_t slot, std::uint32_t generation)
 {
-	while (running_)
-	{ // The server will only process data for as long as it's running (fixme)
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return (client_handle(loop.index) << loop_shift_) | (client_handle(generation) << slot_bits_) | slot;
+}
 
-		std::lock_guard guard1(client_mtx_);
-		std::lock_guard guard2(process_mtx_);
+std::uint32_t async_tcp_server::get_slot(client_handle handle)
+{
+	return std::uint32_t(handle & ((1ull << slot_bits_) - 1));
+}
 
-		for (std::size_t i = 0; i < connected_clients_.size(); i++)
-		{
-			auto client = connected_clients_[i];
-			auto &process_buffer = process_buffers_[client];
+async_tcp_server::event_loop *async_tcp_server::find_loop(client_handle handle)
+{
+	// The loops are only ever created by start, so this needs no lock
+	auto index = handle >> loop_shift_;
 
-			if (process_buffer.size() < sizeof(packets::header))
-				continue;
+	if (!handle || index >= event_loops_.size())
+		return nullptr;
+
+	return event_loops_[index].get();
+}
 
-			auto header = reinterpret_cast<packets::header *>(process_buffer.data());
+async_tcp_server::connection *async_tcp_server::find_connection(event_loop &loop, client_handle handle)
+{
+	auto slot = get_slot(handle);
 
-			bool is_disconnect_packet = header->id == packets::ids::id_disconnect && header->flags & packets::flags::fl_disconnect;
+	if (slot >= loop.connections.size())
+		return nullptr;
 
-			// Disconnect if we receive some malformed packet or
-			// when the client wants to disconnect
-			if (header->magic != PACKET_MAGIC || is_disconnect_packet)
-			{
-				disconnect_client(client);
-				continue;
-			}
+	auto &client = loop.connections[slot];
 
-			// We have received a full packet
-			if (process_buffer.size() < header->length)
-				continue;
+	// The slot was released (and maybe taken by another client) since the handle was given out
+	if (client.generation != std::uint32_t(handle >> slot_bits_))
+		return nullptr;
 
-			auto data_start = process_buffer.data() + sizeof(packets::header);
-			std::uint32_t data_length = header->length - sizeof(packets::header);
+	if (client.state != connection_state::handshaking && client.state != connection_state::established)
+		return nullptr;
 
-			// Assign the data to our serializer
-			serializer.assign_buffer(data_start, data_length);
+	return &client;
+}
 
-			// Call the processing callback (it cannot be null)
-			if (header->id > packets::ids::num_preset_ids)
-				process_callback_(this, client, header->id, serializer);
+std::uint64_t async_tcp_server::to_user_data(std::uint64_t operation, client_handle handle)
+{
+	// Every loop only ever sees its own clients, so the loop index can make room for the operation
+	return operation | (handle & handle_mask_);
+}
 
-			// Erase the packet from our buffer (client might've disconnected during callback,
-			// therefore we need to check if the buffer still exists.
-			if (process_buffers_.find(client) != process_buffers_.end())
-				process_buffer.erase(process_buffer.begin(), process_buffer.begin() + data_length + sizeof(packets::header));
-		}
-	}
+client_handle async_tcp_server::from_user_data(const event_loop &loop, std::uint64_t user_data)
+{
+	return (client_handle(loop.index) << loop_shift_) | (user_data & handle_mask_);
 }
 
-void async_tcp_server::receive_data()
+void async_tcp_server::wake_loop(event_loop &loop)
 {
-	std::vector<std::uint8_t> buffer(buffer_size_);
+	std::uint64_t wakeup = 1;
+	write(loop.wakeup_fd, &wakeup, sizeof(wakeup));
+}
 
-	while (running_)
+void async_tcp_server::queue_disconnect(event_loop &loop, client_handle who)
+{
+	std::lock_guard guard(loop.client_mtx);
+	loop.clients_to_disconnect.push_back(who);
+	wake_loop(loop);
+}
+
+void async_tcp_server::adopt_clients(event_loop &loop)
+{
+	std::vector<SOCKET> to_connect = {};
+	std::vector<client_handle> to_disconnect = {}, to_flush = {};
+	std::vector<pending_timer> to_schedule = {};
+	std::vector<timer_id> to_cancel = {};
+
+	{
+		std::lock_guard guard(loop.client_mtx);
+		to_connect.swap(loop.clients_to_connect);
+		to_disconnect.swap(loop.clients_to_disconnect);
+		to_flush.swap(loop.clients_to_flush);
+		to_schedule.swap(loop.timers_to_schedule);
+		to_cancel.swap(loop.timers_to_cancel);
+	}
+
+	for (auto &timer : to_schedule)
+	{
+		auto delay = std::chrono::ceil<std::chrono::milliseconds>(timer.deadline - loop.now);
+
+		loop.user_timers[timer.id] = loop.timers.schedule(delay, [this, &loop, id = timer.id, callback = std::move(timer.callback)]
+														  {
+			loop.user_timers.erase(id);
+			callback(this); });
+	}
+
+	for (auto id : to_cancel)
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		auto it = loop.user_timers.find(id);
+
+		if (it == loop.user_timers.end())
+			continue;
 
-		std::lock_guard guard(client_mtx_);
-		for (std::size_t i = 0; i < connected_clients_.size(); i++)
+		loop.timers.cancel(it->second);
+		loop.user_timers.erase(it);
+	}
+
+	for (auto client : to_connect)
+	{
+		// From now on the client is driven by this loop
+		if (!start_handshake(loop, client))
 		{
-			auto &client = connected_clients_[i];
+			shutdown(client, 2);
+			// closesocket(client);
+			close(client);
+		}
+	}
 
-#if _WIN32 // only perform check with window
+	for (auto client : to_flush)
+		handle_writable(loop, client);
 
-			// Check if we received any data from our client
-			// so we don't block the thread with recv
-			unsigned long available_to_read = 0;
-			ioctlsocket(client, FIONREAD, &available_to_read);
+	for (auto client : to_disconnect)
+		disconnect_client_internal(loop, client);
+}
 
-			if (!available_to_read)
-				continue;
-#endif
+void async_tcp_server::disconnect_client_internal(event_loop &loop, client_handle who)
+{
+	// Disconnected already, or the handle is stale
+	auto client = find_connection(loop, who);
+
+	if (!client)
+		return;
 
-			int bytes_received = recv(client, reinterpret_cast<char *>(buffer.data()), buffer_size_, 0);
+	bool established = client->state == connection_state::established;
 
-			switch (bytes_received)
-			{
-			case -1:
-				// Disconnect the client on error
-				// We don't disconnect him on code 0 as that
-				// implies the client closed the connection by
-				// himself, which means it should've sent a
-				// disconnect packet.
-				disconnect_client(client);
-				break;
-			case 0:
-				break;
-			default: // Received bytes, process them
-				std::lock_guard guard(process_mtx_);
+	loop.timers.cancel(client->handshake_deadline);
+	loop.timers.cancel(client->heartbeat);
+	loop.timers.cancel(client->idle_check);
 
-				auto &process_buffer = process_buffers_[client];
-				process_buffer.insert(process_buffer.end(), buffer.begin(), buffer.begin() + bytes_received);
-			}
-		}
+	{
+		// Whatever is still queued can't be delivered anymore
+		std::lock_guard guard(loop.client_mtx);
+		close_client(loop, who, *client);
 	}
 
-	// Disconnect all clients on shutdown
-	for (auto &client : connected_clients_)
-		disconnect_client(client);
+	// Workers may still be busy with packets of the client,
+	// the callback is queued behind those.
+	if (established && on_disconnect_callback_)
+		dispatch(who, [this, who]
+				 { on_disconnect_callback_(this, who); });
 }
 
-void async_tcp_server::run_heartbeat()
+client_handle async_tcp_server::add_connection(event_loop &loop, SOCKET client)
 {
-	auto next = std::chrono::high_resolution_clock::now() + heartbeat_interval_;
-	while (running_)
+	std::lock_guard guard(loop.client_mtx);
+
+	std::uint32_t slot = 0;
+
+	if (!loop.free_slots.empty())
+	{
+		slot = loop.free_slots.back();
+		loop.free_slots.pop_back();
+	}
+	else
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		// Every slot has to fit into a handle
+		if (loop.connections.size() == (1ull << slot_bits_))
+			return 0;
 
-		if (std::chrono::high_resolution_clock::now() < next)
-			continue;
+		slot = std::uint32_t(loop.connections.size());
+		loop.connections.emplace_back();
+	}
 
-		std::lock_guard client_guard(client_mtx_);
-		for (auto it = connected_clients_.begin(); it != connected_clients_.end();)
-		{
-			auto &client = *it;
+	auto &entry = loop.connections[slot];
 
-			auto header = construct_packet_header(0, packets::ids::id_heartbeat, packets::flags::fl_heartbeat);
+	entry.socket = client;
+	entry.state = connection_state::handshaking;
 
-			// If we failed to send the packet, something is wrong. Disconnect the client
-			if (!send_packet_internal(client, &header, sizeof(header)))
-				disconnect_client(client);
-			else
-				it++;
-		}
+	return make_handle(loop, slot, entry.generation);
+}
+
+void async_tcp_server::release_connection(event_loop &loop, connection &client)
+{
+	std::lock_guard guard(loop.client_mtx);
+
+	client.socket = -1;
+	client.state = connection_state::unused;
+
+	// 0 is skipped so a handle is never 0
+	if (!++client.generation)
+		client.generation = 1;
+
+	// The processing buffer keeps its memory for the next client taking the slot
+	client.queue = {};
+	client.process_buffer.clear();
+	client.handshake_deadline = client.heartbeat = client.idle_check = 0;
+	client.ready = false;
+
+#ifdef FI_HAS_IO_URING
+	client.receiving = false;
+#endif // FI_HAS_IO_URING
+
+	loop.free_slots.push_back(std::uint32_t(&client - loop.connections.data()));
+}
+
+bool async_tcp_server::start_handshake(event_loop &loop, SOCKET client)
+{
+#ifdef FI_HAS_IO_URING
+	bool send_now = !loop.uses_ring;
+#else
+	bool send_now = true;
+#endif // FI_HAS_IO_URING
+
+	// The socket was just accepted, so there is always room for our part and it is written in one go
+	if (send_now && send(client, handshake_packet_->data(), handshake_packet_->size(), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(packets::header))
+		return false;
+
+	auto handle = add_connection(loop, client);
+
+	if (!handle)
+		return false;
+
+	auto &entry = loop.connections[get_slot(handle)];
+
+	if (!watch_client(loop, handle, entry))
+	{
+		release_connection(loop, entry);
+		return false;
+	}
+
+	if (!send_now)
+	{
+		// Submitted to the ring together with the receive
+		std::lock_guard guard(loop.client_mtx);
+
+		entry.queue.queued_bytes = handshake_packet_->size();
+		entry.queue.packets.push_back(handshake_packet_);
 
-		auto next = std::chrono::high_resolution_clock::now() + heartbeat_interval_;
+		watch_writable(loop, handle, entry);
 	}
-}
\ No newline at end of file
+
+	entry.last_activity = loop.now;
+
+	// Drop clients which don't answer in time
+	entry.handshake_deadline = loop.timers.schedule(handshake_timeout_, [this, &loop, handle]
+													{ disconnect_client_internal(loop, handle); });
+
+	return true;
+}
+
+bool async_tcp_server::check_handshake(const packets::header &packet_header)
+{
+	// Check the header information for the information we are expecting.
+	// Should be the header with handshake_cl flag
+	if (packet_header.flags != packets::flags::fl_handshake_cl)
+		return false;
+
+	if (packet_header.id != packets::ids::id_handshake)
+		return false;
+
+	if (packet_header.length != sizeof(packets::header))
+		return false;
+
+	if (packet_header.magic != PACKET_MAGIC)
+		return false;
+
+	return true;
+}
+
+void async_tcp_server::establish_client(event_loop &loop, client_handle handle)
+{
+	auto client = find_connection(loop, handle);
+
+	loop.timers.cancel(client->handshake_deadline);
+	client->handshake_deadline = 0;
+
+	{
+		// From now on the client can be sent to
+		std::lock_guard guard(loop.client_mtx);
+		client->state = connection_state::established;
+	}
+
+	schedule_heartbeat(loop, handle);
+
+	if (idle_timeout_.count())
+		schedule_idle_check(loop, handle, idle_timeout_);
+
+	if (on_connect_callback)
+		dispatch(handle, [this, handle]
+				 { on_connect_callback(this, handle); });
+}
+
+bool async_tcp_server::watch_client(event_loop &loop, client_handle handle, connection &client)
+{
+	if (!set_non_blocking(client.socket))
+		return false;
+
+#ifdef FI_HAS_IO_URING
+	if (loop.uses_ring)
+	{
+		// Submitted together with everything else on the next wait
+		loop.ring.prep_multishot_recv(client.socket, to_user_data(receive_completion_, handle));
+		client.receiving = true;
+		return true;
+	}
+#endif // FI_HAS_IO_URING
+
+	epoll_event client_event = {};
+	client_event.events = EPOLLIN | EPOLLRDHUP;
+	client_event.data.u64 = to_user_data(receive_completion_, handle);
+
+	return epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client.socket, &client_event) != -1;
+}
+
+void async_tcp_server::close_client(event_loop &loop, client_handle handle, connection &client)
+{
+	shutdown(client.socket, 2);
+
+#ifdef FI_HAS_IO_URING
+	if (loop.uses_ring)
+	{
+		// The operations in flight complete due to the shutdown (or the cancellation), the
+		// socket is closed and the slot released once we saw the last completion of both.
+		if (client.receiving || client.queue.writable_armed)
+		{
+			if (client.receiving)
+				loop.ring.prep_cancel(to_user_data(receive_completion_, handle), ignored_completion_);
+
+			if (client.queue.writable_armed)
+				loop.ring.prep_cancel(to_user_data(send_completion_, handle), ignored_completion_);
+
+			client.state = connection_state::closing;
+			return;
+		}
+
+		// closesocket(client.socket);
+		close(client.socket);
+		release_connection(loop, client);
+		return;
+	}
+#endif // FI_HAS_IO_URING
+
+	// Remove the socket from the epoll set before closing it, as the
+	// descriptor may be reused by the next accepted client.
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, client.socket, nullptr);
+
+	// closesocket(client.socket);
+	close(client.socket);
+	release_connection(loop, client);
+}
+
+void async_tcp_server::watch_writable(event_loop &loop, client_handle handle, connection &client)
+{
+	auto &queue = client.queue;
+	bool wanted = !queue.packets.empty();
+
+	if (wanted == queue.writable_armed)
+		return;
+
+#ifdef FI_HAS_IO_URING
+	if (loop.uses_ring)
+	{
+		// The send waits for room on its own. Only one is in flight at a time, once it
+		// completed the packets it wrote are dropped and the rest is submitted.
+		if (wanted)
+		{
+			if (loop.sends_queued == loop.sends.size())
+				loop.sends.emplace_back().iovecs.resize(max_iovecs_);
+
+			auto &send = loop.sends[loop.sends_queued++];
+
+			send.message.msg_iov = send.iovecs.data();
+			send.message.msg_iovlen = gather_packets(queue, send.iovecs.data());
+
+			loop.ring.prep_sendmsg(client.socket, &send.message, to_user_data(send_completion_, handle));
+			queue.writable_armed = true;
+		}
+
+		return;
+	}
+#endif // FI_HAS_IO_URING
+
+	epoll_event client_event = {};
+	client_event.events = EPOLLIN | EPOLLRDHUP | (wanted ? std::uint32_t(EPOLLOUT) : 0u);
+	client_event.data.u64 = to_user_data(receive_completion_, handle);
+
+	if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, client.socket, &client_event) != -1)
+		queue.writable_armed = wanted;
+}
+
+void async_tcp_server::handle_writable(event_loop &loop, client_handle handle)
+{
+	bool failed = false, drained = false;
+
+	{
+		std::lock_guard guard(loop.client_mtx);
+
+		auto client = find_connection(loop, handle);
+
+		if (!client)
+			return;
+
+		auto &queue = client->queue;
+
+#ifdef FI_HAS_IO_URING
+		// Submits the next send instead
+		if (!loop.uses_ring)
+#endif // FI_HAS_IO_URING
+			failed = !flush_client(client->socket, queue);
+
+		if (!failed)
+			watch_writable(loop, handle, *client);
+
+		if (queue.congested && queue.queued_bytes <= send_low_watermark_)
+		{
+			queue.congested = false;
+			drained = true;
+		}
+	}
+
+	// Neither of these may run while we hold the lock
+	if (failed)
+	{
+		disconnect_client_internal(loop, handle);
+		return;
+	}
+
+	if (drained && on_drain_callback_)
+		dispatch(handle, [this, handle]
+				 { on_drain_callback_(this, handle); });
+}
+
+#ifdef FI_HAS_IO_URING
+bool async_tcp_server::handle_sent(event_loop &loop, client_handle handle, int result)
+{
+	{
+		std::lock_guard guard(loop.client_mtx);
+
+		// The slot is kept for the client as long as its send is in flight
+		auto &client = loop.connections[get_slot(handle)];
+
+		client.queue.writable_armed = false;
+
+		if (client.state == connection_state::closing)
+		{
+			if (!client.receiving)
+			{
+				// closesocket(client.socket);
+				close(client.socket);
+				release_connection(loop, client);
+			}
+
+			return true;
+		}
+
+		if (result > 0)
+			pop_written(client.queue, result);
+	}
+
+	// The client closed the connection or an error occurred
+	if (result < 0 && result != -EINTR && result != -EAGAIN)
+		return false;
+
+	// Submits whatever is left or was queued in the meantime
+	handle_writable(loop, handle);
+	return true;
+}
+#endif // FI_HAS_IO_URING
+
+void async_tcp_server::schedule_heartbeat(event_loop &loop, client_handle handle)
+{
+	auto client = find_connection(loop, handle);
+
+	if (!client)
+		return;
+
+	client->heartbeat = loop.timers.schedule(heartbeat_interval_, [this, &loop, handle]
+											 {
+		// Queued behind everything else, a client failing to take it gets disconnected
+		queue_packet(loop, handle, heartbeat_packet_);
+		schedule_heartbeat(loop, handle); });
+}
+
+void async_tcp_server::schedule_idle_check(event_loop &loop, client_handle handle, std::chrono::milliseconds delay)
+{
+	auto client = find_connection(loop, handle);
+
+	if (!client)
+		return;
+
+	client->idle_check = loop.timers.schedule(delay, [this, &loop, handle]
+											  {
+		auto client = find_connection(loop, handle);
+
+		if (!client)
+			return;
+
+		auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(loop.now - client->last_activity);
+
+		// The client was active in the meantime, check again once it could've been idle for long enough
+		if (idle < idle_timeout_)
+		{
+			schedule_idle_check(loop, handle, idle_timeout_ - idle);
+			return;
+		}
+
+		disconnect_client_internal(loop, handle); });
+}
+
+int async_tcp_server::run_timers(event_loop &loop)
+{
+	loop.now = detail::timer_wheel::clock::now();
+	loop.timers.advance(loop.now);
+
+	return loop.timers.next_timeout(loop.now);
+}
+
+void async_tcp_server::drain_client(event_loop &loop, client_handle handle)
+{
+	auto client = find_connection(loop, handle);
+	auto &process_buffer = client->process_buffer;
+
+	client->last_activity = loop.now;
+
+	while (true)
+	{
+		// Receive straight into the processing buffer
+		auto buffer = process_buffer.prepare(buffer_size_);
+		int bytes_received = recv(client->socket, reinterpret_cast<char *>(buffer), process_buffer.writable(), 0);
+
+		if (bytes_received > 0)
+		{
+			process_buffer.commit(bytes_received);
+			continue;
+		}
+
+		// We read everything there was to read
+		if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (bytes_received == -1 && errno == EINTR)
+			continue;
+
+		// Disconnect the client on error or once it closed the connection.
+		// A well behaved client should've sent a disconnect packet first,
+		// but a readable socket returning 0 would otherwise wake us forever.
+		disconnect_client_internal(loop, handle);
+		return;
+	}
+}
+
+bool async_tcp_server::process_client(event_loop &loop, client_handle handle)
+{
+	for (std::uint32_t processed = 0;; processed++)
+	{
+		// The client might've been disconnected by the callback
+		auto client = find_connection(loop, handle);
+
+		if (!client)
+			return false;
+
+		auto &process_buffer = client->process_buffer;
+
+		if (process_buffer.size() < sizeof(packets::header))
+			return false;
+
+		auto header = reinterpret_cast<packets::header *>(process_buffer.data());
+
+		// The first thing a client sends has to be its part of the handshake
+		if (client->state == connection_state::handshaking)
+		{
+			if (!check_handshake(*header))
+			{
+				disconnect_client_internal(loop, handle);
+				return false;
+			}
+
+			process_buffer.consume(sizeof(packets::header));
+			establish_client(loop, handle);
+			continue;
+		}
+
+		bool is_disconnect_packet = header->id == packets::ids::id_disconnect && header->flags & packets::flags::fl_disconnect;
+
+		// Disconnect if we receive some malformed packet or
+		// when the client wants to disconnect
+		if (header->magic != PACKET_MAGIC || header->length < sizeof(packets::header) || is_disconnect_packet)
+		{
+			disconnect_client_internal(loop, handle);
+			return false;
+		}
+
+		// We have not received the full packet yet
+		if (process_buffer.size() < header->length)
+			return false;
+
+		// Let the other clients have their turn first
+		if (processed == processing_budget_)
+			return true;
+
+		packets::packet_id id = header->id;
+		auto data_start = process_buffer.data() + sizeof(packets::header);
+		std::uint32_t data_length = header->length - sizeof(packets::header);
+
+		if (id <= packets::ids::num_preset_ids)
+		{
+			process_buffer.consume(data_length + sizeof(packets::header));
+			continue;
+		}
+
+		if (worker_count_)
+		{
+			// The packet gets a serializer of its own, as it is processed later on.
+			// Its copy is the buffer views handed to the callback point into.
+			packets::detail::binary_serializer serializer = {};
+			serializer.assign_buffer(data_start, data_length);
+
+			process_buffer.consume(data_length + sizeof(packets::header));
+
+			workers_.submit(handle, [this, handle, id, serializer = std::move(serializer)]() mutable
+							{
+				if (!handlers_.dispatch(this, handle, id, serializer))
+					disconnect_client(handle); });
+			continue;
+		}
+
+		// Read straight from the processing buffer. Nothing writes to it until the callback
+		// returned, as only this thread receives into it.
+		loop.serializer.borrow_buffer(data_start, data_length);
+
+		// Consume the packet before calling back, the callback is free to disconnect
+		// the client. Both leave the data where it is.
+		process_buffer.consume(data_length + sizeof(packets::header));
+
+		// Call the handler of the packet. A malformed packet
+		// is treated like a malformed header.
+		if (!handlers_.dispatch(this, handle, id, loop.serializer))
+			disconnect_client_internal(loop, handle);
+	}
+}
+
+void async_tcp_server::dispatch(client_handle handle, std::function<void()> callback)
+{
+	if (worker_count_)
+		workers_.submit(handle, std::move(callback));
+	else
+		callback();
+}
+
+void async_tcp_server::process_ready_clients(event_loop &loop)
+{
+	thread_local std::vector<client_handle> ready = {};
+
+	ready.clear();
+	ready.swap(loop.ready_clients);
+
+	for (auto handle : ready)
+	{
+		// Disconnected since it was marked
+		auto client = find_connection(loop, handle);
+
+		if (!client)
+			continue;
+
+		client->ready = false;
+
+		if (process_client(loop, handle))
+			mark_ready(loop, handle);
+	}
+}
+
+void async_tcp_server::mark_ready(event_loop &loop, client_handle handle)
+{
+	auto client = find_connection(loop, handle);
+
+	if (!client || client->ready)
+		return;
+
+	client->ready = true;
+	loop.ready_clients.push_back(handle);
+}
+
+void async_tcp_server::accept_clients()
+{
+	// Clients accepted for every loop, handed over once the backlog is empty
+	std::vector<std::vector<SOCKET>> accepted(event_loops_.size());
+
+#ifdef FI_HAS_IO_URING
+	// With io_uring a single multishot accept takes every client, the kernel
+	// hands us as many as it accepted since we last looked in one go.
+	detail::io_ring ring = {};
+
+	if (backend_ == io_backend::uring && ring.init(accept_ring_entries_, 0, 0))
+		ring.prep_multishot_accept(server_socket_, 0);
+#endif // FI_HAS_IO_URING
+
+	while (running_)
+	{
+#ifdef FI_HAS_IO_URING
+		if (ring.is_initialized())
+		{
+			// Ends once the socket got closed
+			if (ring.submit_and_wait(1) == -1 && errno != EINTR)
+				break;
+
+			ring.for_each_completion([&](const io_uring_cqe &cqe)
+									 {
+				if (cqe.res >= 0)
+					accepted[next_loop_++ % event_loops_.size()].push_back(cqe.res);
+
+				if (!detail::io_ring::has_more(cqe) && running_)
+					ring.prep_multishot_accept(server_socket_, 0); });
+		}
+		else
+#endif // FI_HAS_IO_URING
+		{
+			// Sleep until clients are waiting to be accepted (or the socket got closed)
+			pollfd listening = {server_socket_, POLLIN, 0};
+
+			if (poll(&listening, 1, -1) == -1)
+				continue;
+
+			// The loops perform the handshakes, so nothing keeps us
+			// from accepting everything the backlog holds in one go.
+			while (true)
+			{
+				auto client = accept4(server_socket_, nullptr, nullptr, SOCK_NONBLOCK);
+
+				if (client == -1)
+				{
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+
+					break;
+				}
+
+				accepted[next_loop_++ % event_loops_.size()].push_back(client);
+			}
+		}
+
+		// Every loop is woken up once, no matter how many clients it got
+		for (std::size_t i = 0; i < accepted.size(); i++)
+		{
+			if (accepted[i].empty())
+				continue;
+
+			auto &loop = *event_loops_[i];
+
+			{
+				std::lock_guard guard(loop.client_mtx);
+				loop.clients_to_connect.insert(loop.clients_to_connect.end(), accepted[i].begin(), accepted[i].end());
+			}
+
+			wake_loop(loop);
+			accepted[i].clear();
+		}
+	}
+}
+
+void async_tcp_server::run_event_loop(event_loop *loop)
+{
+	loop->now = detail::timer_wheel::clock::now();
+
+#ifdef FI_HAS_IO_URING
+	loop->uses_ring = backend_ == io_backend::uring && loop->ring.init(ring_entries_, ring_buffers_, buffer_size_);
+
+	if (loop->uses_ring)
+		run_ring_loop(*loop);
+	else
+#endif // FI_HAS_IO_URING
+		run_epoll_loop(*loop);
+
+	// Clients handed over right before we stopped still need closing
+	adopt_clients(*loop);
+
+	// Disconnect all clients on shutdown, including those still handshaking
+	for (std::uint32_t slot = 0; slot < loop->connections.size(); slot++)
+	{
+		auto &client = loop->connections[slot];
+
+		if (client.state == connection_state::handshaking || client.state == connection_state::established)
+			disconnect_client_internal(*loop, make_handle(*loop, slot, client.generation));
+	}
+
+#ifdef FI_HAS_IO_URING
+	// Nobody is waiting for these receives anymore
+	for (auto &client : loop->connections)
+	{
+		if (client.state != connection_state::closing)
+			continue;
+
+		close(client.socket);
+		release_connection(*loop, client);
+	}
+#endif // FI_HAS_IO_URING
+}
+
+void async_tcp_server::run_epoll_loop(event_loop &loop)
+{
+	epoll_event events[max_events_] = {};
+
+	int timeout = run_timers(loop);
+
+	while (running_)
+	{
+		// Sleep until at least one client has data for us, another thread wakes us up or a timer
+		// is due, unless there still are packets left over from the last pass.
+		int num_events = epoll_wait(loop.epoll_fd, events, max_events_, loop.ready_clients.empty() ? timeout : 0);
+
+		loop.now = detail::timer_wheel::clock::now();
+
+		if (num_events == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for (int i = 0; i < num_events && running_; i++)
+		{
+			if (events[i].data.u64 == wakeup_completion_)
+			{
+				std::uint64_t wakeup = 0;
+				read(loop.wakeup_fd, &wakeup, sizeof(wakeup));
+
+				adopt_clients(loop);
+				continue;
+			}
+
+			auto client = from_user_data(loop, events[i].data.u64);
+
+			// The client might've been disconnected by an earlier event of this batch,
+			// its slot may even belong to a client accepted since.
+			if (!find_connection(loop, client))
+				continue;
+
+			if (events[i].events & ~EPOLLOUT)
+			{
+				drain_client(loop, client);
+				mark_ready(loop, client);
+			}
+
+			// Does nothing if the client got disconnected while draining
+			if (events[i].events & EPOLLOUT)
+				handle_writable(loop, client);
+		}
+
+		process_ready_clients(loop);
+
+		timeout = run_timers(loop);
+	}
+}
+
+#ifdef FI_HAS_IO_URING
+void async_tcp_server::run_ring_loop(event_loop &loop)
+{
+	std::vector<client_handle> closed_by = {};
+	std::vector<std::pair<client_handle, int>> sent = {};
+
+	loop.ring.prep_multishot_poll(loop.wakeup_fd, POLLIN, wakeup_completion_);
+
+	int timeout = run_timers(loop);
+
+	while (running_)
+	{
+		// Hand everything we queued to the kernel in one go and sleep until at least one operation
+		// completed or a timer is due, unless there still are packets left over from the last pass.
+		if (loop.ring.submit_and_wait(loop.ready_clients.empty() ? 1 : 0, timeout) == -1 && errno != EINTR && errno != ETIME)
+			break;
+
+		// The kernel copied the messages of the sends, they can be reused
+		if (loop.ring.is_submitted())
+			loop.sends_queued = 0;
+
+		loop.now = detail::timer_wheel::clock::now();
+
+		bool woken = false;
+
+		closed_by.clear();
+		sent.clear();
+
+		loop.ring.for_each_completion([&](const io_uring_cqe &cqe)
+									  {
+			if (cqe.user_data == ignored_completion_)
+				return;
+
+			if (cqe.user_data == wakeup_completion_)
+			{
+				if (!detail::io_ring::has_more(cqe))
+					loop.ring.prep_multishot_poll(loop.wakeup_fd, POLLIN, wakeup_completion_);
+
+				woken = true;
+				return;
+			}
+
+			auto handle = from_user_data(loop, cqe.user_data);
+
+			if ((cqe.user_data & ~handle_mask_) == send_completion_)
+			{
+				sent.emplace_back(handle, cqe.res);
+				return;
+			}
+
+			// The slot is kept for the client as long as its receive is in flight
+			auto &client = loop.connections[get_slot(handle)];
+			bool open = client.state != connection_state::closing;
+
+			if (cqe.res > 0 && detail::io_ring::has_buffer(cqe))
+			{
+				auto buffer_id = detail::io_ring::get_buffer_id(cqe);
+				auto data = loop.ring.get_buffer(buffer_id);
+
+				// The client might've been disconnected while this was in flight
+				if (open)
+				{
+					client.process_buffer.append(data, cqe.res);
+					client.last_activity = loop.now;
+					mark_ready(loop, handle);
+				}
+
+				loop.ring.recycle_buffer(buffer_id);
+			}
+
+			if (detail::io_ring::has_more(cqe))
+				return;
+
+			// The multishot receive has ended
+			client.receiving = false;
+
+			if (!open)
+			{
+				// Otherwise the completion of the send does this
+				if (!client.queue.writable_armed)
+				{
+					// closesocket(client.socket);
+					close(client.socket);
+					release_connection(loop, client);
+				}
+
+				return;
+			}
+
+			// It ends on its own once we ran out of buffers, simply rearm it
+			if (cqe.res > 0 || cqe.res == -ENOBUFS)
+			{
+				loop.ring.prep_multishot_recv(client.socket, to_user_data(receive_completion_, handle));
+				client.receiving = true;
+				return;
+			}
+
+			// The client closed the connection or an error occurred
+			closed_by.push_back(handle); });
+
+		if (woken)
+		{
+			std::uint64_t wakeup = 0;
+			read(loop.wakeup_fd, &wakeup, sizeof(wakeup));
+
+			adopt_clients(loop);
+		}
+
+		for (auto [handle, result] : sent)
+		{
+			if (!handle_sent(loop, handle, result))
+				closed_by.push_back(handle);
+		}
+
+		process_ready_clients(loop);
+
+		// Only dropped after processing so packets sent right before closing aren't lost
+		for (auto client : closed_by)
+			disconnect_client_internal(loop, client);
+
+		timeout = run_timers(loop);
+	}
+}
+#endif // FI_HAS_IO_URING
@@ -19,6 +19,12 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 #else
 #error OS unknown or not supported.
@@ -30,92 +36,460 @@
 #include <unordered_map>
 #include <mutex>
 #include <functional>
-
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <span>
+
+#include "../../shared/buffer_pool/buffer_pool.h"
+#include "../../shared/io_ring/io_ring.h"
+#include "../../shared/packet_handlers/packet_handlers.h"
 #include "../../shared/packets/packets.h"
+#include "../../shared/stream_buffer/stream_buffer.h"
+#include "../../shared/timer_wheel/timer_wheel.h"
+#include "../../shared/worker_pool/worker_pool.h"
 
 namespace fi
 {
 	using SOCKET = int;
 
+	// Identifies a client of async_tcp_server. Unlike sockets, handles are never reused,
+	// so a handle kept around after its client disconnected never refers to another client.
+	using client_handle = std::uint64_t;
+
 	class async_tcp_server
 	{
 	public:
 		async_tcp_server();
 		~async_tcp_server();
 
-		void start(std::string_view port);
+		// Starts the server with the given amount of event loop threads.
+		// Each thread owns the clients handed to it and does all of
+		// their receiving and processing.
+		void start(std::string_view port, std::size_t thread_count = 1);
 		void stop();
 
-		void disconnect_client(SOCKET who);
+		void disconnect_client(client_handle who);
 
 		bool is_running();
 
-		void send_packet(SOCKET to, packets::base_packet *packet);
+		enum class send_result : std::uint8_t
+		{
+			ok = 0,		   // The packet was sent or queued
+			backpressure,  // The packet was queued, but the client's queue is above the high watermark
+			not_connected  // The client is not (or no longer) connected, nothing was queued
+		};
+
+		// Never blocks. Whatever the socket can't take right away is queued and
+		// written by the event loop owning the client once it becomes writable.
+		// Once backpressure was reported, the drain callback tells when to carry on.
+		send_result send_packet(client_handle to, packets::base_packet *packet);
+
+		// Send the packet to every connected client, or to the given ones. The packet is
+		// serialized once and all send queues share the result. Clients which aren't
+		// connected are skipped. Returns the amount of clients the packet was queued for.
+		std::size_t broadcast(packets::base_packet *packet);
+		std::size_t send_to_many(std::span<const client_handle> to, packets::base_packet *packet);
+
+		// Registers the handler for packets of type P, which gets called with the packet
+		// already deserialized. The server keeps a few instances of P to deserialize into,
+		// which are reused for the next packets. Clients sending packets which fail to
+		// deserialize get disconnected. Must be registered before starting the server.
+		template <typename P, typename F>
+		void on(F handler)
+		{
+			if (running_)
+				throw exception(exception::reason_id::already_running, "async_tcp_server::on: attempted to register a handler while running");
+
+			handlers_.on<P>(std::move(handler));
+		}
+
+		// The callback will be called once a packet without a handler of its own is
+		// received. You must register either this callback or a handler before you
+		// start the server, as not doing so will result in an exception.
+		void register_callback(std::function<void(async_tcp_server *const, const client_handle, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn);
 
-		// The callback will be called once a packet is received. You must register
-		// your callback before you start the server, as not doing so will result
-		// in an exception.
-		void register_callback(std::function<void(async_tcp_server *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> callback_fn);
+		// How many packets of the id were received and how many of them were malformed,
+		// only counted for packets with a handler
+		detail::packet_stats get_packet_stats(packets::packet_id id);
 
 		// This function will be called as soon as the server stops.
 		void register_stop_callback(std::function<void(async_tcp_server *const)> callback_fn);
 
 		// This function will be called as soon as a client dis/connects from/to the server.
-		void register_connect_callback(std::function<void(async_tcp_server *const, const SOCKET)> callback_fn);
-		void register_disconnect_callback(std::function<void(async_tcp_server *const, const SOCKET)> callback_fn);
+		void register_connect_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn);
+		void register_disconnect_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn);
+
+		// This function will be called once the send queue of a client which went
+		// above the high watermark drained below the low watermark again.
+		void register_drain_callback(std::function<void(async_tcp_server *const, const client_handle)> callback_fn);
+
+		// Sets the maximum amount of packets processed for one client before the other
+		// clients of the same loop get their turn, so a flooding client can't starve them.
+		void set_processing_budget(std::uint32_t packets_per_client);
+
+		// Sets the amount of worker threads running the callbacks. With no workers
+		// (the default) callbacks run on the event loop threads. With workers,
+		// callbacks of different clients run in parallel, while the callbacks
+		// of one client still run one after another in order.
+		// Must be set before starting the server.
+		void set_worker_count(std::size_t worker_count);
+
+		// Selects how the event loops drive their clients. Must be set before
+		// starting the server. io_backend::uring silently falls back to epoll
+		// if the kernel does not support it.
+		void set_io_backend(io_backend backend);
+
+		// Sets the amount of queued bytes per client above which send_packet reports
+		// backpressure, and below which the queue counts as drained again.
+		void set_send_watermarks(std::size_t low, std::size_t high);
+
+		// Disconnects clients which haven't sent us anything for the given amount
+		// of time. 0 (the default) keeps idle clients connected forever.
+		// Must be set before starting the server.
+		void set_idle_timeout(std::chrono::milliseconds timeout);
+
+		using timer_id = std::uint64_t;
+
+		// Calls the callback once the delay has passed, on one of the event loop
+		// threads. Timers can only be scheduled while the server is running and
+		// are dropped once it stops. Returns an id to cancel the timer with.
+		timer_id schedule_timer(std::chrono::milliseconds delay, std::function<void(async_tcp_server *const)> callback);
+
+		// Does nothing if the timer already ran
+		void cancel_timer(timer_id id);
 
 	private:
 #ifdef _WIN32
 		WSADATA wsa_data_ = {};
 #endif // _WIN32
 
+		// A serialized packet, never modified once created so any amount
+		// of send queues may hold on to it at the same time. Both the buffer
+		// and its reference count come from the buffer pool.
+		using shared_buffer = std::shared_ptr<const detail::pooled_bytes>;
+
+		// Packets waiting to be written to a client
+		struct send_queue
+		{
+			std::deque<shared_buffer, detail::pool_allocator<shared_buffer>> packets = {};
+
+			// Bytes of the front packet which were already written
+			std::size_t front_offset = 0;
+			std::size_t queued_bytes = 0;
+
+			// Set once the queue went above the high watermark, until it drained below the low one
+			bool congested = false;
+
+			// The backend of the loop tells us once the socket becomes writable.
+			// With io_uring this means a send is in flight, which the loop submitted.
+			bool writable_armed = false;
+		};
+
+		enum class connection_state : std::uint8_t
+		{
+			unused = 0,
+
+			// Clients are handed to the loop right after being accepted. Until they
+			// answered our handshake they aren't connected as far as the user is
+			// concerned, so they neither get callbacks nor can be sent to.
+			handshaking,
+			established,
+
+			// Disconnected, but the slot is kept until the receive and send in flight completed
+			// so the socket can't be reused in the meantime (io_uring only)
+			closing
+		};
+
+		// Everything we keep about a client, stored in the connection table of its loop
+		struct connection
+		{
+			// These may only be changed by the loop thread with the client_mtx held,
+			// other threads read them (and use the send queue) with the lock held.
+			SOCKET socket = -1;
+			connection_state state = connection_state::unused;
+
+			// Bumped whenever the slot is released, so handles of earlier clients don't match anymore
+			std::uint32_t generation = 1;
+
+			// Outgoing data, any thread may send. Whoever finds the queue empty
+			// writes right away, a non-empty queue is the loop's job.
+			send_queue queue = {};
+
+			// The rest is only accessed by the loop thread
+			detail::stream_buffer process_buffer = {};
+
+			detail::timer_wheel::timer_id handshake_deadline = 0, heartbeat = 0, idle_check = 0;
+
+			// Last time the client sent us anything
+			detail::timer_wheel::clock::time_point last_activity = {};
+
+			// The client is in ready_clients
+			bool ready = false;
+
+#ifdef FI_HAS_IO_URING
+			// A multishot receive is in flight
+			bool receiving = false;
+#endif // FI_HAS_IO_URING
+		};
+
+		// A timer handed to a loop by schedule_timer
+		struct pending_timer
+		{
+			timer_id id = 0;
+			detail::timer_wheel::clock::time_point deadline = {};
+			std::function<void(async_tcp_server *const)> callback = {};
+		};
+
+#ifdef FI_HAS_IO_URING
+		// A sendmsg submitted to the ring, pointing to the queued packets of a client
+		struct ring_send
+		{
+			msghdr message = {};
+			std::vector<iovec> iovecs = {};
+		};
+#endif // FI_HAS_IO_URING
+
+		// Every event loop runs on its own thread and owns a subset of the
+		// connected clients. Receiving and processing data of a client only
+		// ever happens on the thread of the loop owning it.
+		struct event_loop
+		{
+			// Part of the handles of the clients owned by this loop
+			std::uint8_t index = 0;
+
+			// The loop waits on this epoll instance for readable clients.
+			// The eventfd is registered with it so other threads can wake it up.
+			int epoll_fd = -1, wakeup_fd = -1;
+
+			// Guards the connection table against other threads. The loop thread
+			// itself only needs it when changing the table.
+			std::recursive_mutex client_mtx = {};
+
+			// Slot map of the clients, a client handle tells the slot and its generation.
+			// Released slots are reused, so the table stays as large as the peak amount of clients.
+			std::vector<connection> connections = {};
+			std::vector<std::uint32_t> free_slots = {};
+
+			// Sockets accepted for this loop, and clients dropped or left unwritten data
+			// by other threads. Picked up on the next wakeup.
+			std::vector<SOCKET> clients_to_connect = {};
+			std::vector<client_handle> clients_to_disconnect = {}, clients_to_flush = {};
+
+			// Timers scheduled or cancelled by other threads, picked up on the next wakeup
+			std::vector<pending_timer> timers_to_schedule = {};
+			std::vector<timer_id> timers_to_cancel = {};
+
+			// Drives heartbeats, idle checks and user timers. Only accessed by the loop thread,
+			// as is the map below and the time the loop last woke up.
+			detail::timer_wheel timers = {};
+			std::unordered_map<timer_id, detail::timer_wheel::timer_id> user_timers = {};
+			detail::timer_wheel::clock::time_point now = {};
+
+			// Clients with data waiting to be processed. Clients exceeding the processing
+			// budget stay in here and the loop doesn't sleep until they've been served.
+			std::vector<client_handle> ready_clients = {};
+
+			// This will help us in deserializing our packet data
+			packets::detail::binary_serializer serializer = {};
+
+#ifdef FI_HAS_IO_URING
+			// Used instead of epoll if the io_uring backend was selected and is supported
+			detail::io_ring ring = {};
+			bool uses_ring = false;
+
+			// What the sends queued since the last submission are described by. The kernel
+			// copied them once submitted, so they're reused by the sends of the next pass.
+			// A deque, as the ring holds on to their addresses until then.
+			std::deque<ring_send> sends = {};
+			std::size_t sends_queued = 0;
+#endif // FI_HAS_IO_URING
+
+			std::thread thread = {};
+		};
+
 		packets::header construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags);
 
-		// We have a seperate function which will perform a handshake with the client
-		// to make sure we are talking to a client which will understand our packets.
-		bool perform_handshake(SOCKET with);
+		// Serializes the packet into a buffer holding the header followed by its data
+		shared_buffer serialize_packet(packets::base_packet *packet);
+
+		// Appends the data to the send queue of the client and writes as much as the socket takes
+		send_result queue_packet(event_loop &loop, client_handle to, shared_buffer data);
+
+		// Writes queued packets until the queue is empty or the socket is full.
+		// Must be called with the client_mtx of the loop held. Returns false on error.
+		// Not used by loops running io_uring, which submit their sends to the ring.
+		bool flush_client(SOCKET client, send_queue &queue);
+
+		// Points the iovecs to as many queued packets as fit, returns how many it took
+		static std::size_t gather_packets(const send_queue &queue, iovec *iovecs);
+
+		// Drops the packets written completely, keeps track of how much of the front one was
+		static void pop_written(send_queue &queue, std::size_t written);
+
+		// Switches a socket into non-blocking mode so the event loop never stalls on it
+		bool set_non_blocking(SOCKET s);
+
+		// A handle holds the index of the loop owning the client (8 bits), the generation
+		// of its slot (32 bits) and the slot in the connection table of the loop (24 bits).
+		static client_handle make_handle(const event_loop &loop, std::uint32_t slot, std::uint32_t generation);
+		static std::uint32_t get_slot(client_handle handle);
+
+		// Returns the loop the client belongs to, or nullptr for handles which never were valid
+		event_loop *find_loop(client_handle handle);
+
+		// Returns the client if the handle still refers to it, nullptr once it disconnected.
+		// Other threads than the loop's must hold its client_mtx.
+		connection *find_connection(event_loop &loop, client_handle handle);
+
+		// The user data of epoll events and io_uring completions: what happened in the top
+		// byte (where handles keep the loop index), the handle of the client in the rest.
+		static std::uint64_t to_user_data(std::uint64_t operation, client_handle handle);
+		static client_handle from_user_data(const event_loop &loop, std::uint64_t user_data);
+
+		void wake_loop(event_loop &loop);
+
+		// Lets the loop drop the client on its next wakeup. Used whenever we are
+		// not on the loop thread or must not call back into user code right away.
+		void queue_disconnect(event_loop &loop, client_handle who);
+
+		// These may only be called from the thread of the given loop
+		void adopt_clients(event_loop &loop);
+		void disconnect_client_internal(event_loop &loop, client_handle who);
+
+		// Takes a slot for the socket, returns 0 if the table is full
+		client_handle add_connection(event_loop &loop, SOCKET client);
+
+		// Frees the slot of a client whose socket was closed
+		void release_connection(event_loop &loop, connection &client);
+
+		// We perform a handshake with every client to make sure we are talking to a client which
+		// will understand our packets. The loop sends our part and the client has until the deadline
+		// to answer, its answer is the first thing process_client looks at.
+		bool start_handshake(event_loop &loop, SOCKET client);
+		bool check_handshake(const packets::header &packet_header);
+
+		// Makes a client which completed the handshake known to the user
+		void establish_client(event_loop &loop, client_handle handle);
+
+		// Starts or stops receiving from the client on the loop's backend
+		bool watch_client(event_loop &loop, client_handle handle, connection &client);
+		void close_client(event_loop &loop, client_handle handle, connection &client);
+
+		// Asks the backend of the loop to tell us once the client becomes writable
+		// while data is queued, and to stop once the queue is empty. With io_uring
+		// the queued packets are submitted as a send right away instead.
+		// Must be called from the thread of the loop with its client_mtx held.
+		void watch_writable(event_loop &loop, client_handle handle, connection &client);
+
+		// Called by the loop once the client became writable, or another thread left data queued
+		void handle_writable(event_loop &loop, client_handle handle);
 
-		// Function for sending our packet
-		bool send_packet_internal(SOCKET to, void *const data, const packets::packet_length length);
+#ifdef FI_HAS_IO_URING
+		// Called by the loop once a send of the client completed, returns false if the client
+		// has to be dropped. Takes care of the slot of a client disconnected in the meantime.
+		bool handle_sent(event_loop &loop, client_handle handle, int result);
+#endif // FI_HAS_IO_URING
+
+		// Sends the client a heartbeat every heartbeat_interval_
+		void schedule_heartbeat(event_loop &loop, client_handle handle);
+
+		// Disconnects the client once it didn't send anything for idle_timeout_
+		void schedule_idle_check(event_loop &loop, client_handle handle, std::chrono::milliseconds delay);
+
+		// Runs the timers which are due. Returns the milliseconds until
+		// the loop has to wake up again, -1 if it may sleep indefinitely.
+		int run_timers(event_loop &loop);
+
+		// Reads everything available on the socket until the kernel reports EAGAIN
+		void drain_client(event_loop &loop, client_handle handle);
+
+		// Dispatches the complete packets sitting in the buffer of the client, up to
+		// the processing budget. Returns true if complete packets were left over.
+		bool process_client(event_loop &loop, client_handle handle);
+
+		// Runs a callback concerning the client, on a worker if we have any
+		void dispatch(client_handle handle, std::function<void()> callback);
+
+		// Gives every client which received data (or has packets left over) a turn
+		void process_ready_clients(event_loop &loop);
+		void mark_ready(event_loop &loop, client_handle handle);
 
 		// These functions are running in a thread
 		void accept_clients();
-		void process_data();
-		void receive_data();
-		void run_heartbeat();
+		void run_event_loop(event_loop *loop);
+		void run_epoll_loop(event_loop &loop);
+#ifdef FI_HAS_IO_URING
+		void run_ring_loop(event_loop &loop);
+#endif // FI_HAS_IO_URING
 
-		bool running_ = false;
+		std::atomic<bool> running_ = false;
 
-		// This specifies the buffer size when receiving data.
-		// It does not affect the size of the processing queue.
+		// This specifies the minimum amount of room we make in a
+		// processing buffer when receiving, and the size of the
+		// io_uring receive buffers.
 		const std::uint32_t buffer_size_ = PACKET_BUFFER_SIZE;
 
 		// The amount of time to wait between heartbeat packets
 		const std::chrono::duration<long long> heartbeat_interval_ = std::chrono::seconds(5);
 
-		SOCKET server_socket_ = 0;
+		// All clients share the same heartbeat packet, and our part of the handshake
+		shared_buffer heartbeat_packet_ = {}, handshake_packet_ = {};
 
-		std::mutex send_mtx_ = {}, disconnect_mtx_ = {};
+		// A client failing to complete the handshake within this time gets dropped
+		const std::chrono::seconds handshake_timeout_ = std::chrono::seconds(5);
 
-		// These CAN be accessed in the same thread multiple times, therefore we
-		// need to make these recursive.
-		std::recursive_mutex client_mtx_ = {}, process_mtx_ = {};
+		std::chrono::milliseconds idle_timeout_ = std::chrono::milliseconds(0);
 
-		std::vector<SOCKET> clients_to_disconnect_ = {};
+		// User timers are spread over the loops by their id
+		std::atomic<timer_id> next_timer_id_ = 1;
 
-		std::vector<SOCKET> connected_clients_ = {};
-		std::unordered_map<SOCKET, std::vector<std::uint8_t>> process_buffers_ = {};
+		// Maximum amount of events handled per epoll_wait call
+		static constexpr int max_events_ = 64;
 
-		std::function<void(async_tcp_server *const, const SOCKET)> on_connect_callback = {}, on_disconnect_callback_ = {};
-		std::function<void(async_tcp_server *const)> on_stop_callback_ = {};
+		// Maximum amount of queued packets handed to a single sendmsg call (or send submitted to a ring)
+		static constexpr std::size_t max_iovecs_ = 64;
+
+		std::size_t send_low_watermark_ = 64 * 1024, send_high_watermark_ = 1024 * 1024;
+
+		io_backend backend_ = io_backend::readiness;
 
-		// Our main processing callback
-		std::function<void(async_tcp_server *const, const SOCKET, const packets::packet_id, packets::detail::binary_serializer &)> process_callback_ = {};
+		std::uint32_t processing_budget_ = 64;
+
+		std::size_t worker_count_ = 0;
+		detail::worker_pool workers_ = {};
+
+		// Size of the io_uring submission queue and amount of receive buffers per loop
+		static constexpr std::uint32_t ring_entries_ = 256;
+		static constexpr std::uint16_t ring_buffers_ = 256;
+
+		// Size of the submission queue of the accepting thread's ring, which only ever holds its accept
+		static constexpr std::uint32_t accept_ring_entries_ = 4;
+
+		// Layout of a client handle, from the lowest bits up
+		static constexpr std::uint32_t slot_bits_ = 24, generation_bits_ = 32, loop_shift_ = slot_bits_ + generation_bits_;
+		static constexpr std::uint64_t handle_mask_ = (1ull << loop_shift_) - 1;
+		static constexpr std::size_t max_event_loops_ = 256;
+
+		// What an epoll event or io_uring completion is about, see to_user_data.
+		// Completions we are not interested in, e.g. of cancellations, are ignored.
+		static constexpr std::uint64_t receive_completion_ = 0ull << loop_shift_, send_completion_ = 1ull << loop_shift_,
+									   wakeup_completion_ = 2ull << loop_shift_, ignored_completion_ = ~0ull;
+
+		SOCKET server_socket_ = 0;
+
+		std::vector<std::unique_ptr<event_loop>> event_loops_ = {};
+
+		// Accepted clients are handed to the loops in a round-robin fashion
+		std::size_t next_loop_ = 0;
+
+		std::function<void(async_tcp_server *const, const client_handle)> on_connect_callback = {}, on_disconnect_callback_ = {}, on_drain_callback_ = {};
+		std::function<void(async_tcp_server *const)> on_stop_callback_ = {};
 
-		std::thread accepting_thread_ = {}, processing_thread_ = {}, receiving_thread_ = {}, heartbeat_thread_{};
+		// Our packet handlers, register_callback sets their fallback
+		detail::packet_handlers<async_tcp_server *const, const client_handle> handlers_ = {};
 
-		// This will help us in serializing our packet data
-		packets::detail::binary_serializer serializer = {};
+		std::thread accepting_thread_ = {};
 
 	public:
 		class exception : public std::exception
@@ -132,7 +506,12 @@ namespace fi
 				null_callback,
 				no_callback,
 				bind_error,
-				listen_error
+				listen_error,
+				epoll_failure,
+				invalid_thread_count,
+				invalid_budget,
+				invalid_watermarks,
+				not_running
 			};
 
 			exception(reason_id reason, std::string_view what) : reason_(reason), what_(what) {};
@@ -0,0 +1,145 @@
+#include "address_map.h"
+
+#include <cstring>
+#include <random>
+
+#include <netinet/in.h>
+
+using namespace fi::detail;
+
+address_map::address_map()
+{
+	std::random_device random = {};
+	seed_ = (std::uint64_t(random()) << 32) | random();
+
+	entries_.resize(64);
+}
+
+std::uint32_t address_map::find(const sockaddr_storage &address)
+{
+	auto &entry = entries_[probe(make_key(address))];
+
+	return entry.used ? entry.value : npos;
+}
+
+void address_map::insert(const sockaddr_storage &address, std::uint32_t value)
+{
+	// Keep at least half of the entries free, which keeps the probe sequences short
+	if ((size_ + 1) * 2 > entries_.size())
+		grow();
+
+	auto converted = make_key(address);
+	auto &entry = entries_[probe(converted)];
+
+	entry.address = converted;
+	entry.value = value;
+	entry.used = true;
+
+	size_++;
+}
+
+void address_map::erase(const sockaddr_storage &address)
+{
+	auto index = probe(make_key(address));
+
+	if (!entries_[index].used)
+		return;
+
+	entries_[index].used = false;
+	size_--;
+
+	// Move the entries following it back into the gap where possible, so no probe
+	// sequence is cut short by it. That spares us from marking it as deleted.
+	auto mask = entries_.size() - 1;
+
+	for (auto next = (index + 1) & mask; entries_[next].used; next = (next + 1) & mask)
+	{
+		auto home = get_index(entries_[next].address);
+
+		// Entries between the gap and where they'd want to be have to stay
+		if (((next - home) & mask) < ((next - index) & mask))
+			continue;
+
+		entries_[index] = entries_[next];
+		entries_[next].used = false;
+
+		index = next;
+	}
+}
+
+std::size_t address_map::size()
+{
+	return size_;
+}
+
+void address_map::clear()
+{
+	for (auto &entry : entries_)
+		entry.used = false;
+
+	size_ = 0;
+}
+
+address_map::key address_map::make_key(const sockaddr_storage &address)
+{
+	key converted = {};
+	auto bytes = reinterpret_cast<std::uint8_t *>(converted.words);
+
+	if (address.ss_family == AF_INET6)
+	{
+		auto &ipv6 = reinterpret_cast<const sockaddr_in6 &>(address);
+
+		memcpy(bytes, &ipv6.sin6_family, 2);
+		memcpy(bytes + 2, &ipv6.sin6_port, 2);
+		memcpy(bytes + 4, &ipv6.sin6_scope_id, 4);
+		memcpy(bytes + 8, &ipv6.sin6_addr, 16);
+	}
+	else
+	{
+		auto &ipv4 = reinterpret_cast<const sockaddr_in &>(address);
+
+		memcpy(bytes, &ipv4.sin_family, 2);
+		memcpy(bytes + 2, &ipv4.sin_port, 2);
+		memcpy(bytes + 4, &ipv4.sin_addr, 4);
+	}
+
+	return converted;
+}
+
+std::size_t address_map::get_index(const key &address)
+{
+	std::uint64_t hash = seed_;
+
+	for (auto word : address.words)
+	{
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+		hash ^= hash >> 32;
+	}
+
+	return hash & (entries_.size() - 1);
+}
+
+std::size_t address_map::probe(const key &address)
+{
+	auto mask = entries_.size() - 1;
+	auto index = get_index(address);
+
+	while (entries_[index].used && !(entries_[index].address == address))
+		index = (index + 1) & mask;
+
+	return index;
+}
+
+void address_map::grow()
+{
+	auto old_entries = std::move(entries_);
+
+	entries_ = {};
+	entries_.resize(old_entries.size() * 2);
+
+	for (auto &entry : old_entries)
+	{
+		if (entry.used)
+			entries_[probe(entry.address)] = entry;
+	}
+}
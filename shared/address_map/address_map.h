@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace fi::detail
+{
+	// Maps addresses of datagram senders to a value, e.g. the slot of their session.
+	// Entries live in a single flat array using linear probing, so a lookup usually
+	// touches a single cache line. The hash is seeded randomly per map, so senders
+	// can't pick addresses which all end up in the same place of the array.
+	// Not thread safe.
+	class address_map
+	{
+	public:
+		// Returned by find for addresses which aren't in the map
+		static constexpr std::uint32_t npos = ~std::uint32_t(0);
+
+		address_map();
+
+		std::uint32_t find(const sockaddr_storage &address);
+
+		// The address must not be in the map yet
+		void insert(const sockaddr_storage &address, std::uint32_t value);
+		void erase(const sockaddr_storage &address);
+
+		std::size_t size();
+		void clear();
+
+	private:
+		// The parts of an address which tell senders apart, IPv4 addresses only fill the front
+		struct key
+		{
+			std::uint64_t words[3] = {};
+
+			bool operator==(const key &other) const = default;
+		};
+
+		struct entry
+		{
+			key address = {};
+			std::uint32_t value = 0;
+			bool used = false;
+		};
+
+		static key make_key(const sockaddr_storage &address);
+		std::size_t get_index(const key &address);
+
+		// Index of the entry holding the key, or of the free one it would go into
+		std::size_t probe(const key &address);
+
+		void grow();
+
+		std::vector<entry> entries_ = {};
+		std::size_t size_ = 0;
+
+		std::uint64_t seed_ = 0;
+	};
+} // namespace fi::detail
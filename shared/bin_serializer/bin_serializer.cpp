@@ -1,16 +1,18 @@
 #include "bin_serializer.h"
 
+#include <algorithm>
+
 using namespace fi::packets::detail;
 
 void binary_serializer::serialize(const std::string &item)
 {
-	write_to_buffer<std::uint32_t>(item.length());
+	write_length(item.length());
 	serialized_buffer_.insert(serialized_buffer_.end(), item.begin(), item.end());
 }
 
 void binary_serializer::serialize(const std::vector<std::string> &item)
 {
-	write_to_buffer<std::uint32_t>(item.size());
+	write_length(item.size());
 
 	for (auto &s : item)
 		serialize(s);
@@ -18,46 +20,196 @@ void binary_serializer::serialize(const std::vector<std::string> &item)
 
 void binary_serializer::deserialize(std::string &out_item)
 {
-	auto length = read_from_buffer<std::uint32_t>();
+	auto length = read_length();
+
+	// The length comes from the peer, never trust it
+	if (!can_read(length))
+	{
+		out_item.clear();
+		return;
+	}
 
 	out_item.resize(length);
-	memcpy(out_item.data(), serialized_buffer_.data() + deserialized_bytes_, length);
+	memcpy(out_item.data(), read_position(), length);
 
 	deserialized_bytes_ += length;
 }
 
-void binary_serializer::deserialize(std::vector<std::string> &out_item)
+void binary_serializer::deserialize(std::string_view &out_item)
 {
-	auto num_strings = read_from_buffer<std::uint32_t>();
+	auto length = read_length();
 
-	out_item.resize(num_strings);
-	for (std::uint32_t i = 0; i < num_strings; i++)
+	if (!can_read(length))
 	{
-		std::string deserialized = "";
-		deserialize(deserialized);
+		out_item = {};
+		return;
+	}
+
+	out_item = {reinterpret_cast<const char *>(read_position()), length};
+
+	deserialized_bytes_ += length;
+}
 
-		out_item[i] = std::move(deserialized);
+void binary_serializer::deserialize(std::vector<std::string> &out_item)
+{
+	auto num_strings = read_length();
+
+	// Every string takes at least its length, which bounds the amount we allocate
+	std::uint64_t min_length_size = encoding_ == encoding::compact ? 1 : sizeof(std::uint32_t);
+
+	if (!can_read(num_strings * min_length_size))
+	{
+		out_item.clear();
+		return;
 	}
+
+	// Read into the strings already there, so they keep their capacity
+	out_item.resize(num_strings);
+	for (std::uint32_t i = 0; i < num_strings && !failed_; i++)
+		deserialize(out_item[i]);
+
+	if (failed_)
+		out_item.clear();
 }
 
 std::uint8_t *binary_serializer::get_serialized_data()
 {
-	return serialized_buffer_.data();
+	return serialized_buffer_.data() + header_length_;
 }
 
 std::uint32_t binary_serializer::get_serialized_data_length()
 {
-	return serialized_buffer_.size();
+	return serialized_buffer_.size() - header_length_;
+}
+
+std::uint8_t *binary_serializer::append_bytes(std::uint32_t length)
+{
+	auto offset = serialized_buffer_.size();
+	serialized_buffer_.resize(offset + length);
+
+	return serialized_buffer_.data() + offset;
+}
+
+const std::uint8_t *binary_serializer::read_bytes(std::uint32_t length)
+{
+	if (!can_read(length))
+		return nullptr;
+
+	auto data = read_position();
+	deserialized_bytes_ += length;
+
+	return data;
+}
+
+void binary_serializer::set_encoding(encoding value)
+{
+	encoding_ = value;
+}
+
+encoding binary_serializer::get_encoding()
+{
+	return encoding_;
+}
+
+std::uint64_t binary_serializer::read_long_varint(std::uint64_t max)
+{
+	std::uint64_t value = 0;
+
+	// A 64 bit value takes at most 10 bytes
+	for (std::uint32_t shift = 0; shift < 70; shift += 7)
+	{
+		if (!can_read(1))
+			return 0;
+
+		auto byte = *read_position();
+		deserialized_bytes_++;
+
+		// The last of the 10 bytes only has a single bit left to give
+		if (shift == 63 && byte > 1)
+			break;
+
+		// Overlong, a value has a single encoding and it never ends in a 0
+		if (shift && !byte)
+			break;
+
+		value |= std::uint64_t(byte & 0x7f) << shift;
+
+		if (byte < 0x80)
+		{
+			if (value > max)
+				break;
+
+			return value;
+		}
+	}
+
+	// Too long, overlong or too large for what we're reading, the data is broken
+	failed_ = true;
+	return 0;
+}
+
+bool binary_serializer::has_failed()
+{
+	return failed_;
 }
 
 void binary_serializer::reset()
 {
 	deserialized_bytes_ = 0;
+	header_length_ = 0;
 	serialized_buffer_.clear();
+
+	borrowed_buffer_ = nullptr;
+	borrowed_length_ = 0;
+
+	failed_ = false;
+	encoding_ = encoding::fixed;
+}
+
+void binary_serializer::reserve_header(std::uint32_t length)
+{
+	reset();
+
+	// A buffer taken by take_frame has to be allocated anew,
+	// make it large enough right away so it doesn't keep growing.
+	serialized_buffer_.reserve(std::max<std::size_t>(last_frame_length_, length));
+	serialized_buffer_.resize(length);
+
+	header_length_ = length;
+}
+
+std::uint8_t *binary_serializer::get_frame_data()
+{
+	return serialized_buffer_.data();
+}
+
+std::uint32_t binary_serializer::get_frame_length()
+{
+	return serialized_buffer_.size();
+}
+
+fi::detail::pooled_bytes binary_serializer::take_frame()
+{
+	last_frame_length_ = serialized_buffer_.size();
+
+	auto frame = std::move(serialized_buffer_);
+
+	serialized_buffer_ = {};
+	reset();
+
+	return frame;
 }
 
 void binary_serializer::assign_buffer(std::uint8_t *const data, std::uint32_t length)
 {
 	reset();
 	serialized_buffer_.insert(serialized_buffer_.begin(), data, data + length);
+}
+
+void binary_serializer::borrow_buffer(const std::uint8_t *data, std::uint32_t length)
+{
+	reset();
+
+	borrowed_buffer_ = data;
+	borrowed_length_ = length;
 }
\ No newline at end of file
@@ -1,15 +1,87 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 #include <vector>
+#include <span>
 #include <string>
+#include <string_view>
 
-#define ARITHMETIC_TYPE_ONLY typename std::enable_if<std::is_arithmetic<T>::value>::type * = nullptr
+#include "../buffer_pool/buffer_pool.h"
 
-// TODO: add endianness
+#define ARITHMETIC_TYPE_ONLY typename std::enable_if<std::is_arithmetic<T>::value>::type * = nullptr
 
 namespace fi::packets::detail
 {
+	// Byte order of everything we send, no matter what the host uses. Little endian
+	// hosts (practically all of them) send their values as they are.
+	inline constexpr std::endian wire_endian = std::endian::little;
+
+	// Compilers turn this into a single byte swap instruction
+	template <typename T>
+	T byte_swap(T value)
+	{
+		auto bytes = std::bit_cast<std::array<std::uint8_t, sizeof(T)>>(value);
+		std::reverse(bytes.begin(), bytes.end());
+
+		return std::bit_cast<T>(bytes);
+	}
+
+	// Converts a value from host to wire byte order and back, does nothing on hosts matching the wire
+	template <typename T>
+	T to_wire_order(T value)
+	{
+		if constexpr (sizeof(T) == 1 || std::endian::native == wire_endian)
+			return value;
+		else
+			return byte_swap(value);
+	}
+
+	// Converts count items of the given size in place. Done in one pass over
+	// the whole array, which compilers vectorize, instead of item by item.
+	template <std::size_t size>
+	void to_wire_order(std::uint8_t *items, std::size_t count)
+	{
+		if constexpr (size == 1 || std::endian::native == wire_endian)
+			return;
+		else
+		{
+			for (std::size_t i = 0; i < count; i++)
+				std::reverse(items + i * size, items + (i + 1) * size);
+		}
+	}
+
+	// A value kept in wire byte order, for structs which are sent as they are.
+	// Reads and writes to it are done in host byte order.
+	template <typename T>
+	class wire_value
+	{
+	public:
+		wire_value() = default;
+		wire_value(T value) : value_(to_wire_order(value)) {}
+
+		operator T() const
+		{
+			return to_wire_order(value_);
+		}
+
+	private:
+		T value_ = 0;
+	};
+
+	// How lengths and integers are written. fixed writes them at their full width,
+	// compact as varints (LEB128, 7 bits per byte), with signed integers zigzag encoded
+	// first so small negative values stay short too. Floats, single bytes and the items
+	// of arrays are written at their full width either way.
+	enum class encoding
+	{
+		fixed,
+		compact
+	};
+
 	class binary_serializer
 	{
 	public:
@@ -17,37 +89,72 @@ namespace fi::packets::detail
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		void serialize(T item)
 		{
+			if constexpr (is_varint_type<T>())
+			{
+				if (encoding_ == encoding::compact)
+				{
+					write_varint(to_unsigned(item));
+					return;
+				}
+			}
+
 			write_to_buffer(item);
 		}
 
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		void serialize(std::vector<T> &item)
 		{
-			write_to_buffer<std::uint32_t>(item.size());
+			write_length(item.size());
+
+			auto offset = serialized_buffer_.size();
 
 			serialized_buffer_.insert(
 				serialized_buffer_.end(),
 				reinterpret_cast<std::uint8_t *>(item.data()),
 				reinterpret_cast<std::uint8_t *>(item.data()) + item.size() * sizeof(T));
+
+			to_wire_order<sizeof(T)>(serialized_buffer_.data() + offset, item.size());
 		}
 
 		void serialize(const std::string &item);
 		void serialize(const std::vector<std::string> &item);
 
-		// Methods for deserialization
+		// Methods for deserialization. Reading past the end of the data (e.g. due to a
+		// length sent by a broken or malicious peer) reads nothing and sets has_failed,
+		// items read from then on are zero or empty. Strings and vectors are read into
+		// what they hold already, deserializing into the same items over and over only
+		// allocates once they need to grow.
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		void deserialize(T &item)
 		{
+			if constexpr (is_varint_type<T>())
+			{
+				if (encoding_ == encoding::compact)
+				{
+					item = from_unsigned<T>(read_varint(std::numeric_limits<std::make_unsigned_t<T>>::max()));
+					return;
+				}
+			}
+
 			item = read_from_buffer<T>();
 		}
 
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		void deserialize(std::vector<T> &out_item)
 		{
-			auto num_items = read_from_buffer<std::uint32_t>();
+			auto num_items = read_length();
+
+			// Checked once for the whole array, before allocating anything for it
+			if (!can_read(std::uint64_t(num_items) * sizeof(T)))
+			{
+				out_item.clear();
+				return;
+			}
 
 			out_item.resize(num_items);
-			memcpy(out_item.data(), serialized_buffer_.data() + deserialized_bytes_, num_items * sizeof(T));
+			memcpy(out_item.data(), read_position(), num_items * sizeof(T));
+
+			to_wire_order<sizeof(T)>(reinterpret_cast<std::uint8_t *>(out_item.data()), num_items);
 
 			deserialized_bytes_ += num_items * sizeof(T);
 		}
@@ -55,16 +162,170 @@ namespace fi::packets::detail
 		void deserialize(std::string &out_item);
 		void deserialize(std::vector<std::string> &out_item);
 
+		// Zero-copy counterparts of the above. The views point into the buffer we read from,
+		// so they are only valid as long as it is (with a borrowed buffer: during the callback).
+		template <typename T, ARITHMETIC_TYPE_ONLY>
+		void deserialize(std::span<const T> &out_item)
+		{
+			static_assert(sizeof(T) == 1 || std::endian::native == wire_endian,
+						  "views can't convert the byte order, deserialize into a std::vector instead");
+
+			auto num_items = read_length();
+
+			if (!can_read(std::uint64_t(num_items) * sizeof(T)))
+			{
+				out_item = {};
+				return;
+			}
+
+			// Unlike every other read this relies on unaligned access being fine
+			out_item = {reinterpret_cast<const T *>(read_position()), num_items};
+
+			deserialized_bytes_ += num_items * sizeof(T);
+		}
+
+		void deserialize(std::string_view &out_item);
+
+		// Raw access for callers writing or reading several values at once, which convert
+		// the byte order themselves. append_bytes returns room for length bytes at the end,
+		// read_bytes the next length bytes or nullptr (failing the serializer) if there aren't enough.
+		std::uint8_t *append_bytes(std::uint32_t length);
+		const std::uint8_t *read_bytes(std::uint32_t length);
+
+		// Selects how the following items are written and read, reset goes back to encoding::fixed.
+		// Both sides have to use the same one for a packet, packet<> sets it for packets declaring it.
+		void set_encoding(encoding value);
+		encoding get_encoding();
+
+		// Whether a read ran past the end of the data since the last reset.
+		// Check it once done deserializing a packet.
+		bool has_failed();
+
+		// The serialized data, without the space reserved for a header
 		std::uint8_t *get_serialized_data();
 		std::uint32_t get_serialized_data_length();
 
 		void reset();
+
+		// Resets and keeps the given amount of bytes free at the front, for a header which is
+		// written once the length of the data is known. The buffer then holds the whole frame
+		// as it goes out, so it doesn't have to be copied into another one.
+		void reserve_header(std::uint32_t length);
+
+		template <typename T>
+		void write_header(const T &header)
+		{
+			memcpy(serialized_buffer_.data(), &header, sizeof(T));
+		}
+
+		// The header followed by the data
+		std::uint8_t *get_frame_data();
+		std::uint32_t get_frame_length();
+
+		// Hands the frame over, leaving the serializer empty. The next frame
+		// starts out with as much room as this one took, from the buffer pool.
+		fi::detail::pooled_bytes take_frame();
+
+		// Copies the data, it may be freed as soon as this returns
 		void assign_buffer(std::uint8_t *const data, std::uint32_t length);
 
+		// Reads straight from the data instead of a copy of it, which must stay
+		// untouched until we're done reading. Only meant for deserializing,
+		// reset before serializing anything again.
+		void borrow_buffer(const std::uint8_t *data, std::uint32_t length);
+
 	private:
+		// Integers which get shorter as varints, bools and single bytes can't
+		template <typename T>
+		static constexpr bool is_varint_type()
+		{
+			return std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) > 1;
+		}
+
+		// Zigzag maps signed values to unsigned ones, small magnitudes to small values: 0, -1, 1, -2 -> 0, 1, 2, 3
+		template <typename T>
+		static std::uint64_t to_unsigned(T value)
+		{
+			if constexpr (std::is_signed_v<T>)
+				return (std::uint64_t(value) << 1) ^ std::uint64_t(std::int64_t(value) >> 63);
+			else
+				return value;
+		}
+
+		template <typename T>
+		static T from_unsigned(std::uint64_t value)
+		{
+			if constexpr (std::is_signed_v<T>)
+				return T((value >> 1) ^ (~(value & 1) + 1));
+			else
+				return T(value);
+		}
+
+		void write_varint(std::uint64_t value)
+		{
+			std::uint8_t bytes[10];
+			std::size_t length = 0;
+
+			for (; value >= 0x80; value >>= 7)
+				bytes[length++] = std::uint8_t(value | 0x80);
+
+			bytes[length++] = std::uint8_t(value);
+
+			serialized_buffer_.insert(serialized_buffer_.end(), bytes, bytes + length);
+		}
+
+		// Values above max fail the serializer like a read past the end. Varints of one and
+		// two bytes, which most lengths and counters fit in, are decoded right here.
+		std::uint64_t read_varint(std::uint64_t max)
+		{
+			auto data = read_position();
+			auto available = this->available() - deserialized_bytes_;
+
+			if (!failed_ && available >= 1 && data[0] < 0x80)
+			{
+				deserialized_bytes_ += 1;
+				return data[0];
+			}
+
+			// A last byte of 0 would make it overlong, read_long_varint rejects those
+			if (!failed_ && available >= 2 && data[1] < 0x80 && data[1] != 0)
+			{
+				std::uint64_t value = (data[0] & 0x7f) | (std::uint64_t(data[1]) << 7);
+
+				if (value <= max)
+				{
+					deserialized_bytes_ += 2;
+					return value;
+				}
+			}
+
+			return read_long_varint(max);
+		}
+
+		std::uint64_t read_long_varint(std::uint64_t max);
+
+		// Lengths of strings and arrays
+		void write_length(std::uint32_t length)
+		{
+			if (encoding_ == encoding::compact)
+				write_varint(length);
+			else
+				write_to_buffer(length);
+		}
+
+		std::uint32_t read_length()
+		{
+			if (encoding_ == encoding::compact)
+				return std::uint32_t(read_varint(std::numeric_limits<std::uint32_t>::max()));
+
+			return read_from_buffer<std::uint32_t>();
+		}
+
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		void write_to_buffer(T item)
 		{
+			item = to_wire_order(item);
+
 			serialized_buffer_.insert(
 				serialized_buffer_.end(),
 				reinterpret_cast<std::uint8_t *>(&item),
@@ -74,13 +335,56 @@ namespace fi::packets::detail
 		template <typename T, ARITHMETIC_TYPE_ONLY>
 		T read_from_buffer()
 		{
-			auto value = *reinterpret_cast<T *>(serialized_buffer_.data() + deserialized_bytes_);
+			T value = {};
+
+			if (!can_read(sizeof(T)))
+				return value;
+
+			memcpy(&value, read_position(), sizeof(T));
+
 			deserialized_bytes_ += sizeof(T);
 
-			return value;
+			return to_wire_order(value);
+		}
+
+		// Whether the given amount of bytes is left to read, fails the serializer if not
+		bool can_read(std::uint64_t length)
+		{
+			if (failed_ || deserialized_bytes_ + length > available())
+			{
+				failed_ = true;
+				return false;
+			}
+
+			return true;
+		}
+
+		// Amount of bytes there are to read, in total
+		std::size_t available()
+		{
+			return borrowed_buffer_ ? borrowed_length_ : serialized_buffer_.size();
+		}
+
+		// Where the next read starts, in the borrowed buffer if there is one
+		const std::uint8_t *read_position()
+		{
+			return (borrowed_buffer_ ? borrowed_buffer_ : serialized_buffer_.data()) + deserialized_bytes_;
 		}
 
 		std::uint32_t deserialized_bytes_ = 0;
-		std::vector<std::uint8_t> serialized_buffer_ = {};
+		fi::detail::pooled_bytes serialized_buffer_ = {};
+
+		// Bytes at the front of the buffer reserved for a header
+		std::uint32_t header_length_ = 0;
+
+		// Size of the last frame taken, reserved for the next one
+		std::size_t last_frame_length_ = 0;
+
+		const std::uint8_t *borrowed_buffer_ = nullptr;
+		std::uint32_t borrowed_length_ = 0;
+
+		bool failed_ = false;
+
+		encoding encoding_ = encoding::fixed;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <mutex>
+
+using namespace fi::detail;
+
+namespace
+{
+	constexpr std::size_t class_count = std::bit_width(buffer_pool::max_block_size / buffer_pool::min_block_size);
+
+	std::size_t get_class(std::size_t size)
+	{
+		if (size <= buffer_pool::min_block_size)
+			return 0;
+
+		return std::bit_width((size - 1) / buffer_pool::min_block_size);
+	}
+
+	std::size_t get_class_size(std::size_t size_class)
+	{
+		return buffer_pool::min_block_size << size_class;
+	}
+
+	// Blocks a thread keeps of a class, up to 256 KiB worth. Once
+	// there are more, half of them go to the shared list.
+	std::size_t get_cache_limit(std::size_t size_class)
+	{
+		return std::clamp<std::size_t>(256 * 1024 / get_class_size(size_class), 4, 256);
+	}
+
+	// Blocks the shared list keeps of a class, up to 16 MiB
+	// worth. Blocks beyond that are given back to the heap.
+	std::size_t get_shared_limit(std::size_t size_class)
+	{
+		return std::clamp<std::size_t>(16 * 1024 * 1024 / get_class_size(size_class), 64, 4096);
+	}
+
+	struct thread_cache;
+
+	struct shared_state
+	{
+		struct block_list
+		{
+			std::mutex mtx = {};
+			std::vector<void *> blocks = {};
+		};
+
+		std::array<block_list, class_count> lists = {};
+
+		std::mutex caches_mtx = {};
+		std::vector<thread_cache *> caches = {};
+
+		// Counted by threads which exited since
+		buffer_pool_stats retired = {};
+	};
+
+	// Never destroyed, buffers may still be released by destructors of other statics
+	shared_state &get_shared()
+	{
+		static auto state = new shared_state();
+		return *state;
+	}
+
+	// Moves blocks into the shared list, giving those it has no room for back to the heap
+	void release_shared(std::size_t size_class, void *const *blocks, std::size_t count)
+	{
+		auto &list = get_shared().lists[size_class];
+		std::size_t kept = 0;
+
+		{
+			std::lock_guard guard(list.mtx);
+
+			kept = std::min(count, get_shared_limit(size_class) - std::min(list.blocks.size(), get_shared_limit(size_class)));
+			list.blocks.insert(list.blocks.end(), blocks, blocks + kept);
+		}
+
+		for (auto i = kept; i < count; i++)
+			::operator delete(blocks[i]);
+	}
+
+	// Only written by the owning thread, but read by get_stats from any
+	void count(std::uint64_t &counter)
+	{
+		std::atomic_ref ref(counter);
+		ref.store(ref.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	struct thread_cache
+	{
+		std::array<std::vector<void *>, class_count> blocks = {};
+		buffer_pool_stats stats = {};
+
+		thread_cache()
+		{
+			// Room for one more than the limit, so releasing never allocates
+			for (std::size_t i = 0; i < class_count; i++)
+				blocks[i].reserve(get_cache_limit(i) + 1);
+
+			auto &shared = get_shared();
+
+			std::lock_guard guard(shared.caches_mtx);
+			shared.caches.push_back(this);
+		}
+
+		~thread_cache();
+	};
+
+	// Blocks released while the thread exits, after its cache is gone, go to the shared list
+	thread_local bool cache_destroyed = false;
+
+	thread_cache::~thread_cache()
+	{
+		cache_destroyed = true;
+
+		for (std::size_t i = 0; i < class_count; i++)
+			release_shared(i, blocks[i].data(), blocks[i].size());
+
+		auto &shared = get_shared();
+
+		std::lock_guard guard(shared.caches_mtx);
+
+		shared.caches.erase(std::find(shared.caches.begin(), shared.caches.end(), this));
+		shared.retired.hits += stats.hits;
+		shared.retired.misses += stats.misses;
+	}
+
+	thread_cache *get_cache()
+	{
+		if (cache_destroyed)
+			return nullptr;
+
+		thread_local thread_cache cache = {};
+		return &cache;
+	}
+
+	// Takes up to half a cache worth of blocks from the shared list
+	void refill(std::size_t size_class, std::vector<void *> &blocks)
+	{
+		auto &list = get_shared().lists[size_class];
+
+		std::lock_guard guard(list.mtx);
+
+		auto count = std::min(list.blocks.size(), get_cache_limit(size_class) / 2);
+
+		blocks.insert(blocks.end(), list.blocks.end() - count, list.blocks.end());
+		list.blocks.resize(list.blocks.size() - count);
+	}
+} // namespace
+
+void *buffer_pool::allocate(std::size_t size)
+{
+	auto cache = get_cache();
+
+	if (size > max_block_size)
+	{
+		if (cache)
+			count(cache->stats.misses);
+
+		return ::operator new(size);
+	}
+
+	auto size_class = get_class(size);
+
+	if (cache)
+	{
+		auto &blocks = cache->blocks[size_class];
+
+		if (blocks.empty())
+			refill(size_class, blocks);
+
+		if (!blocks.empty())
+		{
+			auto block = blocks.back();
+			blocks.pop_back();
+
+			count(cache->stats.hits);
+			return block;
+		}
+
+		count(cache->stats.misses);
+	}
+
+	return ::operator new(get_class_size(size_class));
+}
+
+void buffer_pool::release(void *block, std::size_t size)
+{
+	if (size > max_block_size)
+	{
+		::operator delete(block);
+		return;
+	}
+
+	auto size_class = get_class(size);
+	auto cache = get_cache();
+
+	if (!cache)
+	{
+		release_shared(size_class, &block, 1);
+		return;
+	}
+
+	auto &blocks = cache->blocks[size_class];
+	blocks.push_back(block);
+
+	// Keep the newest half, those are the most likely to still be in the CPU cache
+	if (blocks.size() > get_cache_limit(size_class))
+	{
+		auto count = blocks.size() / 2;
+
+		release_shared(size_class, blocks.data(), count);
+		blocks.erase(blocks.begin(), blocks.begin() + count);
+	}
+}
+
+buffer_pool_stats buffer_pool::get_stats()
+{
+	auto &shared = get_shared();
+
+	std::lock_guard guard(shared.caches_mtx);
+
+	auto stats = shared.retired;
+
+	for (auto cache : shared.caches)
+	{
+		stats.hits += std::atomic_ref(cache->stats.hits).load(std::memory_order_relaxed);
+		stats.misses += std::atomic_ref(cache->stats.misses).load(std::memory_order_relaxed);
+	}
+
+	return stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace fi::detail
+{
+	struct buffer_pool_stats
+	{
+		// Allocations served by a block which was released before
+		std::uint64_t hits = 0;
+
+		// Allocations which went to the heap, as no block of their size was
+		// free or they are larger than the largest size class
+		std::uint64_t misses = 0;
+	};
+
+	// Hands out memory for buffers in size classes of powers of two, from 64 bytes to
+	// 64 KiB. Released blocks are kept for reuse, first in a cache of the releasing thread
+	// which takes no lock, and once that is full in a list shared by all threads, which
+	// threads running out refill their cache from. Once the blocks the traffic needs are
+	// around, buffers are no longer allocated from the heap at all.
+	class buffer_pool
+	{
+	public:
+		static constexpr std::size_t min_block_size = 64;
+		static constexpr std::size_t max_block_size = 64 * 1024;
+
+		// Blocks may be released on any thread, not just the one allocating them
+		static void *allocate(std::size_t size);
+		static void release(void *block, std::size_t size);
+
+		// Summed up over all threads, including those which exited
+		static buffer_pool_stats get_stats();
+	};
+
+	// Lets standard containers draw from the buffer pool
+	template <typename T>
+	class pool_allocator
+	{
+	public:
+		static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "blocks are only aligned like those of operator new");
+
+		using value_type = T;
+
+		pool_allocator() = default;
+
+		template <typename U>
+		pool_allocator(const pool_allocator<U> &) {}
+
+		T *allocate(std::size_t count)
+		{
+			return static_cast<T *>(buffer_pool::allocate(count * sizeof(T)));
+		}
+
+		void deallocate(T *items, std::size_t count)
+		{
+			buffer_pool::release(items, count * sizeof(T));
+		}
+
+		template <typename U>
+		bool operator==(const pool_allocator<U> &) const
+		{
+			return true;
+		}
+	};
+
+	// Bytes of serialized or received data
+	using pooled_bytes = std::vector<std::uint8_t, pool_allocator<std::uint8_t>>;
+} // namespace fi::detail
@@ -0,0 +1,301 @@
+#include "io_ring.h"
+
+#ifdef FI_HAS_IO_URING
+
+#include <algorithm>
+#include <cstdio>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace fi::detail;
+
+io_ring::~io_ring()
+{
+	if (buffer_ring_)
+		munmap(buffer_ring_, buffer_ring_size_);
+
+	if (sqes_)
+		munmap(sqes_, sqes_size_);
+
+	if (cq_ring_ && cq_ring_ != sq_ring_)
+		munmap(cq_ring_, cq_ring_size_);
+
+	if (sq_ring_)
+		munmap(sq_ring_, sq_ring_size_);
+
+	if (ring_fd_ != -1)
+		close(ring_fd_);
+}
+
+bool io_ring::init(std::uint32_t entries, std::uint16_t num_buffers, std::uint32_t buffer_size)
+{
+	// Don't retry after a failed attempt
+	if (ring_fd_ != -1)
+		return initialized_;
+
+	// Multishot receives were added in 6.0, there is no way to probe for them
+	utsname name = {};
+	int major = 0, minor = 0;
+
+	if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6)
+		return false;
+
+	io_uring_params params = {};
+	params.flags = IORING_SETUP_CLAMP;
+
+	ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring_fd_ == -1)
+		return false;
+
+	// Sends point to messages which are only kept until they were submitted
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SUBMIT_STABLE))
+		return false;
+
+	// Map the queues into our address space
+	sq_entries_ = params.sq_entries;
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+	if (single_mmap)
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+	sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+
+	if (sq_ring_ == MAP_FAILED)
+	{
+		sq_ring_ = nullptr;
+		return false;
+	}
+
+	if (single_mmap)
+		cq_ring_ = sq_ring_;
+	else
+	{
+		cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+
+		if (cq_ring_ == MAP_FAILED)
+		{
+			cq_ring_ = nullptr;
+			return false;
+		}
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	auto sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED)
+		return false;
+
+	sqes_ = reinterpret_cast<io_uring_sqe *>(sqes);
+
+	auto sq = reinterpret_cast<std::uint8_t *>(sq_ring_);
+	sq_head_ = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.head);
+	sq_tail_ = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.tail);
+	sq_mask_ = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<std::uint32_t *>(sq + params.sq_off.array);
+	sqe_tail_ = *sq_tail_;
+
+	auto cq = reinterpret_cast<std::uint8_t *>(cq_ring_);
+	cq_head_ = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.head);
+	cq_tail_ = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.tail);
+	cq_mask_ = reinterpret_cast<std::uint32_t *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	if (!num_buffers)
+	{
+		initialized_ = true;
+		return true;
+	}
+
+	// Set up the ring of buffers the kernel will receive into
+	num_buffers_ = num_buffers;
+	buffer_size_ = buffer_size;
+	buffers_.resize(std::size_t(num_buffers) * buffer_size);
+
+	buffer_ring_size_ = num_buffers * sizeof(io_uring_buf);
+	auto buffer_ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+	if (buffer_ring == MAP_FAILED)
+		return false;
+
+	buffer_ring_ = reinterpret_cast<io_uring_buf_ring *>(buffer_ring);
+
+	io_uring_buf_reg reg = {};
+	reg.ring_addr = reinterpret_cast<std::uint64_t>(buffer_ring_);
+	reg.ring_entries = num_buffers;
+	reg.bgid = buffer_group_;
+
+	if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return false;
+
+	for (std::uint16_t i = 0; i < num_buffers; i++)
+		recycle_buffer(i);
+
+	initialized_ = true;
+	return true;
+}
+
+bool io_ring::is_initialized()
+{
+	return initialized_;
+}
+
+void io_ring::prep_multishot_recv(int fd, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = buffer_group_;
+	sqe->user_data = user_data;
+}
+
+void io_ring::prep_sendmsg(int fd, const msghdr *message, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<std::uint64_t>(message);
+	sqe->len = 1;
+
+	// A client which went away must not raise SIGPIPE
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+}
+
+void io_ring::prep_multishot_accept(int fd, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = user_data;
+}
+
+void io_ring::prep_multishot_poll(int fd, std::uint32_t events, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
+
+void io_ring::prep_poll(int fd, std::uint32_t events, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+}
+
+void io_ring::prep_cancel(std::uint64_t target_user_data, std::uint64_t user_data)
+{
+	auto sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target_user_data;
+	sqe->user_data = user_data;
+}
+
+int io_ring::submit_and_wait(std::uint32_t wait_nr, int timeout_ms)
+{
+	std::uint32_t to_submit = sqe_tail_ - *sq_tail_;
+
+	// Publish our queued entries to the kernel
+	__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+	std::uint32_t flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	__kernel_timespec timeout = {};
+	io_uring_getevents_arg arg = {};
+
+	if (wait_nr && timeout_ms >= 0)
+	{
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+
+		arg.ts = reinterpret_cast<std::uint64_t>(&timeout);
+		flags |= IORING_ENTER_EXT_ARG;
+
+		return syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, &arg, sizeof(arg));
+	}
+
+	return syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, nullptr, 0);
+}
+
+bool io_ring::is_submitted()
+{
+	return __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sqe_tail_;
+}
+
+bool io_ring::has_more(const io_uring_cqe &cqe)
+{
+	return cqe.flags & IORING_CQE_F_MORE;
+}
+
+bool io_ring::has_buffer(const io_uring_cqe &cqe)
+{
+	return cqe.flags & IORING_CQE_F_BUFFER;
+}
+
+std::uint16_t io_ring::get_buffer_id(const io_uring_cqe &cqe)
+{
+	return cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+std::uint8_t *io_ring::get_buffer(std::uint16_t buffer_id)
+{
+	return buffers_.data() + std::size_t(buffer_id) * buffer_size_;
+}
+
+void io_ring::recycle_buffer(std::uint16_t buffer_id)
+{
+	// Index the entries ourselves, compiled as C++ the flexible bufs member of
+	// io_uring_buf_ring doesn't start at offset 0 like the kernel expects.
+	auto entries = reinterpret_cast<io_uring_buf *>(buffer_ring_);
+
+	std::uint16_t tail = buffer_ring_->tail;
+	auto &buffer = entries[tail & (num_buffers_ - 1)];
+
+	buffer.addr = reinterpret_cast<std::uint64_t>(get_buffer(buffer_id));
+	buffer.len = buffer_size_;
+	buffer.bid = buffer_id;
+
+	__atomic_store_n(&buffer_ring_->tail, std::uint16_t(tail + 1), __ATOMIC_RELEASE);
+}
+
+io_uring_sqe *io_ring::get_sqe()
+{
+	// The submission queue is full, hand what we have to the kernel first
+	while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+		submit_and_wait(0);
+
+	auto index = sqe_tail_ & *sq_mask_;
+	auto sqe = &sqes_[index];
+
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	sq_array_[index] = index;
+	sqe_tail_++;
+
+	return sqe;
+}
+
+#endif // FI_HAS_IO_URING
@@ -0,0 +1,135 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define FI_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#endif
+
+namespace fi
+{
+	// Selects how sockets are driven. The io_uring backend falls back to
+	// the readiness based one if the kernel does not support it.
+	enum class io_backend : std::uint8_t
+	{
+		readiness = 0, // epoll on the server, blocking recv on the client
+		uring
+	};
+} // namespace fi
+
+#ifdef FI_HAS_IO_URING
+
+namespace fi::detail
+{
+	// Minimal io_uring wrapper talking to the kernel through raw syscalls,
+	// so we don't depend on liburing. Operations are queued with the prep_*
+	// methods and handed to the kernel in one go by submit_and_wait.
+	// Receives pick their memory from a ring of provided buffers which is
+	// registered with the kernel once. Anything else an operation points to
+	// only has to stay put until it was submitted, the kernel copies it then.
+	// Not thread safe, a ring is meant to be driven by a single thread.
+	class io_ring
+	{
+	public:
+		io_ring() = default;
+		~io_ring();
+
+		io_ring(const io_ring &) = delete;
+		io_ring &operator=(const io_ring &) = delete;
+
+		// Returns false if the kernel lacks io_uring or one of the features we
+		// rely on (provided buffer rings, multishot receives: Linux 6.0+).
+		// num_buffers must be a power of two, 0 sets up no buffers at all.
+		bool init(std::uint32_t entries, std::uint16_t num_buffers, std::uint32_t buffer_size);
+		bool is_initialized();
+
+		// Receives into the provided buffers until cancelled, an error occurs or
+		// the buffers run out. Each completion carries one buffer.
+		void prep_multishot_recv(int fd, std::uint64_t user_data);
+
+		// Sends once the socket has room, completes with the amount of bytes written.
+		// The buffers the message points to must stay put until then.
+		void prep_sendmsg(int fd, const msghdr *message, std::uint64_t user_data);
+
+		// Accepts clients until cancelled or an error occurs, each completion carries
+		// the descriptor of a client (switched to non-blocking mode).
+		void prep_multishot_accept(int fd, std::uint64_t user_data);
+
+		// Posts a completion each time the descriptor becomes ready
+		void prep_multishot_poll(int fd, std::uint32_t events, std::uint64_t user_data);
+
+		// Posts a single completion once the descriptor becomes ready
+		void prep_poll(int fd, std::uint32_t events, std::uint64_t user_data);
+
+		void prep_cancel(std::uint64_t target_user_data, std::uint64_t user_data);
+
+		// Submits everything queued and waits for at least wait_nr completions.
+		// A negative timeout waits indefinitely.
+		int submit_and_wait(std::uint32_t wait_nr, int timeout_ms = -1);
+
+		// Whether the kernel took every operation queued so far, it may leave some
+		// in the submission queue e.g. while it is short on memory
+		bool is_submitted();
+
+		// Calls fn for every available completion and marks them as seen
+		template <typename F>
+		std::uint32_t for_each_completion(F fn)
+		{
+			std::uint32_t head = *cq_head_;
+			std::uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			std::uint32_t seen = 0;
+
+			for (; head != tail; head++, seen++)
+				fn(cqes_[head & *cq_mask_]);
+
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+			return seen;
+		}
+
+		// A multishot operation keeps going as long as its completions have more set
+		static bool has_more(const io_uring_cqe &cqe);
+
+		// Tells which provided buffer a receive completion was written to
+		static bool has_buffer(const io_uring_cqe &cqe);
+		static std::uint16_t get_buffer_id(const io_uring_cqe &cqe);
+
+		std::uint8_t *get_buffer(std::uint16_t buffer_id);
+
+		// Hands a buffer back to the kernel once we're done reading it
+		void recycle_buffer(std::uint16_t buffer_id);
+
+	private:
+		io_uring_sqe *get_sqe();
+
+		static constexpr std::uint16_t buffer_group_ = 0;
+
+		bool initialized_ = false;
+		int ring_fd_ = -1;
+
+		// Submission queue
+		void *sq_ring_ = nullptr;
+		std::size_t sq_ring_size_ = 0;
+		io_uring_sqe *sqes_ = nullptr;
+		std::size_t sqes_size_ = 0;
+		std::uint32_t *sq_head_ = nullptr, *sq_tail_ = nullptr, *sq_mask_ = nullptr, *sq_array_ = nullptr;
+		std::uint32_t sq_entries_ = 0, sqe_tail_ = 0;
+
+		// Completion queue (may share the mapping with the submission queue)
+		void *cq_ring_ = nullptr;
+		std::size_t cq_ring_size_ = 0;
+		std::uint32_t *cq_head_ = nullptr, *cq_tail_ = nullptr, *cq_mask_ = nullptr;
+		io_uring_cqe *cqes_ = nullptr;
+
+		// Provided buffers
+		io_uring_buf_ring *buffer_ring_ = nullptr;
+		std::size_t buffer_ring_size_ = 0;
+		std::uint16_t num_buffers_ = 0;
+		std::uint32_t buffer_size_ = 0;
+		std::vector<std::uint8_t> buffers_ = {};
+	};
+} // namespace fi::detail
+
+#endif // FI_HAS_IO_URING
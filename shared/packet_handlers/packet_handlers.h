@@ -0,0 +1,186 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "../packets/packets.h"
+
+namespace fi::detail
+{
+	// How many packets with an id came in, and how many of those failed to deserialize
+	struct packet_stats
+	{
+		std::uint64_t received = 0;
+		std::uint64_t malformed = 0;
+	};
+
+	// Where the threads dispatching packets start looking for a packet instance to decode into.
+	// Handed out in turn, so the first few threads each find one of their own.
+	inline std::size_t get_decoder_hint()
+	{
+		static std::atomic<std::size_t> next_hint = 0;
+		thread_local const std::size_t hint = next_hint.fetch_add(1, std::memory_order_relaxed);
+
+		return hint;
+	}
+
+	// Handlers for received packets, looked up by the packet id in a flat table.
+	// A handler is registered for a packet type and gets called with the packet
+	// already deserialized. Packets without a handler go to the fallback, which
+	// gets the raw data. Args are what the handlers get before the packet.
+	// Handlers must be registered before dispatch is first called, after that
+	// dispatch may be called from any amount of threads.
+	// Every handler keeps a few packet instances, which keep the memory of their
+	// members from packet to packet. A dispatch takes one of them for as long as
+	// the handler runs. Dispatches finding all of them taken (more threads than
+	// instances, or a handler dispatching again) decode into a temporary one.
+	template <typename... Args>
+	class packet_handlers
+	{
+	public:
+		using fallback_fn = std::function<void(Args..., const packets::packet_id, packets::detail::binary_serializer &)>;
+
+		template <typename P, typename F>
+		void on(F handler)
+		{
+			packets::packet_id id = P{}.get_id();
+
+			if (id >= handlers_.size())
+				handlers_.resize(std::size_t(id) + 1);
+
+			handlers_[id].decoder = std::make_shared<decoder<P, F>>(std::move(handler));
+			handlers_[id].decode = &decode<P, F>;
+		}
+
+		void set_fallback(fallback_fn fallback)
+		{
+			fallback_ = std::move(fallback);
+		}
+
+		// Whether anything would be called at all
+		bool empty()
+		{
+			if (fallback_)
+				return false;
+
+			for (auto &entry : handlers_)
+			{
+				if (entry.decode)
+					return false;
+			}
+
+			return true;
+		}
+
+		// Returns false if the packet failed to deserialize
+		bool dispatch(Args... args, packets::packet_id id, packets::detail::binary_serializer &s)
+		{
+			if (id >= handlers_.size() || !handlers_[id].decode)
+			{
+				if (fallback_)
+					fallback_(args..., id, s);
+
+				return true;
+			}
+
+			auto &entry = handlers_[id];
+
+			std::atomic_ref(entry.stats.received).fetch_add(1, std::memory_order_relaxed);
+
+			if (entry.decode(entry.decoder.get(), args..., s))
+				return true;
+
+			std::atomic_ref(entry.stats.malformed).fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		// Only packets with a handler are counted
+		packet_stats get_stats(packets::packet_id id)
+		{
+			if (id >= handlers_.size())
+				return {};
+
+			auto &stats = handlers_[id].stats;
+
+			return {
+				std::atomic_ref(stats.received).load(std::memory_order_relaxed),
+				std::atomic_ref(stats.malformed).load(std::memory_order_relaxed)};
+		}
+
+	private:
+		static constexpr std::size_t instances_ = 8;
+
+		// The handler registered for P and the instances packets are decoded into
+		template <typename P, typename F>
+		struct decoder
+		{
+			explicit decoder(F handler) : handler(std::move(handler)) {}
+
+			F handler;
+
+			std::array<P, instances_> packets = {};
+			std::array<std::atomic<bool>, instances_> taken = {};
+		};
+
+		// Hands the instance back once the handler returned (or threw)
+		struct instance_guard
+		{
+			std::atomic<bool> &taken;
+
+			~instance_guard()
+			{
+				taken.store(false, std::memory_order_release);
+			}
+		};
+
+		template <typename P, typename F>
+		static bool decode_into(P &packet, F &handler, Args... args, packets::detail::binary_serializer &s)
+		{
+			packet.deserialize(s);
+
+			if (s.has_failed())
+				return false;
+
+			handler(args..., packet);
+			return true;
+		}
+
+		// Called through a plain function pointer, which calls the handler directly
+		template <typename P, typename F>
+		static bool decode(void *decoder_state, Args... args, packets::detail::binary_serializer &s)
+		{
+			auto &registered = *static_cast<decoder<P, F> *>(decoder_state);
+			auto hint = get_decoder_hint();
+
+			for (std::size_t i = 0; i < instances_; i++)
+			{
+				auto index = (hint + i) % instances_;
+
+				if (registered.taken[index].exchange(true, std::memory_order_acquire))
+					continue;
+
+				instance_guard guard = {registered.taken[index]};
+				return decode_into(registered.packets[index], registered.handler, args..., s);
+			}
+
+			P packet = {};
+			return decode_into(packet, registered.handler, args..., s);
+		}
+
+		struct entry
+		{
+			// Type erased decoder of the packet type registered for the id, and what decodes with it
+			std::shared_ptr<void> decoder = {};
+			bool (*decode)(void *decoder, Args..., packets::detail::binary_serializer &) = nullptr;
+
+			// Counted by whichever thread dispatches, hence only accessed atomically
+			packet_stats stats = {};
+		};
+
+		std::vector<entry> handlers_ = {};
+		fallback_fn fallback_ = {};
+	};
+} // namespace fi::detail
@@ -16,7 +16,10 @@ namespace fi::packets
 		fl_handshake_cl = (1 << 0),
 		fl_handshake_sv = (1 << 1),
 		fl_heartbeat = (1 << 2),
-		fl_disconnect = (1 << 3)
+		fl_disconnect = (1 << 3),
+		fl_reliable = (1 << 4), // A reliable_header follows the header
+		fl_ack = (1 << 5),		// Acknowledges reliable packets, holds only a reliable_header
+		fl_fragment = (1 << 6)	// A fragment_header follows the header (and reliable_header)
 
 		// Put your custom packet flags here
 	};
@@ -34,18 +37,44 @@ namespace fi::packets
 		id_example
 	};
 
+	typedef std::uint16_t packet_id;
+	typedef std::uint16_t packet_flags;
+	typedef std::uint32_t packet_length;
+
 	// Do NOT remove/change any of these unless you know what you're doing!
+	// The header is sent as it is, its fields are kept in wire byte order.
 	struct header
 	{
-		std::uint32_t magic = PACKET_MAGIC;
-		std::uint16_t id = ids::id_none;
-		std::uint16_t flags = flags::fl_none;
-		std::uint32_t length = sizeof(header);
+		detail::wire_value<std::uint32_t> magic = PACKET_MAGIC;
+		detail::wire_value<packet_id> id = ids::id_none;
+		detail::wire_value<packet_flags> flags = flags::fl_none;
+		detail::wire_value<packet_length> length = sizeof(header);
+	};
+
+	// Follows the header of packets sent over a reliable channel of the UDP talker and listener.
+	// Every packet of a channel gets the next sequence number, ack and ack_bits tell the other
+	// side which of its packets arrived: ack itself and, for every bit n set, ack - n - 1.
+	struct reliable_header
+	{
+		// The fi::delivery the packet was sent with, each has its own sequence numbers
+		std::uint8_t channel = 0;
+		detail::wire_value<std::uint16_t> sequence = 0;
+		detail::wire_value<std::uint16_t> ack = 0;
+		detail::wire_value<std::uint32_t> ack_bits = 0;
 	};
 
-	typedef decltype(header::id) packet_id;
-	typedef decltype(header::flags) packet_flags;
-	typedef decltype(header::length) packet_length;
+	// Follows the headers of the datagrams a UDP packet too large for a single one is split into.
+	// The data of the packet is split into count fragments of the same size, only the last one
+	// may be shorter. Fragments of a packet share its id and the number of the message.
+	struct fragment_header
+	{
+		detail::wire_value<std::uint32_t> message = 0;
+		detail::wire_value<std::uint16_t> index = 0;
+		detail::wire_value<std::uint16_t> count = 0;
+
+		// Of the data of the whole packet
+		detail::wire_value<packet_length> length = 0;
+	};
 
 	// Each packet must be based off this class
 	class base_packet
@@ -0,0 +1,257 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <type_traits>
+
+#include "packet_base.h"
+
+namespace fi::packets
+{
+	namespace detail
+	{
+		template <typename P>
+		struct field_traits;
+
+		template <typename C, typename M>
+		struct field_traits<M C::*>
+		{
+			using type = M;
+
+			// Arithmetic fields always take the same amount of bytes
+			static constexpr bool is_fixed_size = std::is_arithmetic_v<M>;
+		};
+
+		template <typename T>
+		constexpr bool has_fixed_size()
+		{
+			return std::apply([](auto... members)
+							  { return (field_traits<decltype(members)>::is_fixed_size && ...); },
+							  T::fields);
+		}
+
+		template <typename T>
+		constexpr std::size_t fixed_size()
+		{
+			return std::apply([](auto... members)
+							  { return (sizeof(typename field_traits<decltype(members)>::type) + ... + 0); },
+							  T::fields);
+		}
+	} // namespace detail
+
+	// Base for packets which declare their fields once, instead of writing matching
+	// serialize and deserialize methods by hand:
+	//
+	//   class my_packet : public packet<my_packet, ids::id_my>
+	//   {
+	//   public:
+	//       std::uint32_t number = 0;
+	//       std::string text = "";
+	//
+	//       static constexpr auto fields = std::make_tuple(&my_packet::number, &my_packet::text);
+	//   };
+	//
+	// Fields are (de-)serialized in the order they are listed. Packets made of arithmetic
+	// fields only have their size known at compile time, they are written and read as one
+	// block with a single bounds check, which the compiler turns into a few plain moves.
+	//
+	// Packets mostly made of small numbers and short strings can pick encoding::compact,
+	// which writes lengths and integers as varints instead, e.g. packet<my_packet, ids::id_my, encoding::compact>.
+	template <typename T, packet_id ID, detail::encoding E = detail::encoding::fixed>
+	class packet : public base_packet
+	{
+	public:
+		static constexpr packet_id id = ID;
+		static constexpr detail::encoding wire_encoding = E;
+
+		// Called directly (e.g. by packet_table) these don't go through the vtable
+		void write(detail::binary_serializer &s)
+		{
+			auto &self = static_cast<T &>(*this);
+			auto previous = s.get_encoding();
+
+			s.set_encoding(E);
+
+			if constexpr (is_fixed_block())
+			{
+				auto data = s.append_bytes(detail::fixed_size<T>());
+
+				std::apply([&](auto... members)
+						   {
+					std::size_t offset = 0;
+					((write_fixed(data, offset, self.*members)), ...); },
+						   T::fields);
+			}
+			else
+			{
+				std::apply([&](auto... members)
+						   { (s.serialize(self.*members), ...); },
+						   T::fields);
+			}
+
+			s.set_encoding(previous);
+		}
+
+		void read(detail::binary_serializer &s)
+		{
+			auto &self = static_cast<T &>(*this);
+			auto previous = s.get_encoding();
+
+			s.set_encoding(E);
+
+			if constexpr (is_fixed_block())
+			{
+				auto data = s.read_bytes(detail::fixed_size<T>());
+
+				// The packet is too short, its fields are left zero like any other failed read
+				if (!data)
+				{
+					std::apply([&](auto... members)
+							   { ((self.*members = {}), ...); },
+							   T::fields);
+				}
+				else
+				{
+					std::apply([&](auto... members)
+							   {
+						std::size_t offset = 0;
+						((read_fixed(data, offset, self.*members)), ...); },
+							   T::fields);
+				}
+			}
+			else
+			{
+				std::apply([&](auto... members)
+						   { (s.deserialize(self.*members), ...); },
+						   T::fields);
+			}
+
+			s.set_encoding(previous);
+		}
+
+		void serialize(detail::binary_serializer &s) final
+		{
+			write(s);
+		}
+
+		void deserialize(detail::binary_serializer &s) final
+		{
+			read(s);
+		}
+
+		packet_id get_id() final
+		{
+			return ID;
+		}
+
+	private:
+		// Varints take as many bytes as their value needs, only fixed packets can be a single block
+		static constexpr bool is_fixed_block()
+		{
+			return E == detail::encoding::fixed && detail::has_fixed_size<T>();
+		}
+
+		template <typename F>
+		static void write_fixed(std::uint8_t *data, std::size_t &offset, F field)
+		{
+			field = detail::to_wire_order(field);
+			memcpy(data + offset, &field, sizeof(F));
+
+			offset += sizeof(F);
+		}
+
+		template <typename F>
+		static void read_fixed(const std::uint8_t *data, std::size_t &offset, F &field)
+		{
+			memcpy(&field, data + offset, sizeof(F));
+			field = detail::to_wire_order(field);
+
+			offset += sizeof(F);
+		}
+	};
+
+	// Maps packet ids to the packets given, with the table built at compile time.
+	// dispatch decodes a packet into its type and hands it to a handler taking it,
+	// e.g. a lambda with an overload for every packet or a generic one.
+	template <typename... Packets>
+	class packet_table
+	{
+	public:
+		// One instance of every packet, for the packets to be decoded into over and over
+		using instances = std::tuple<Packets...>;
+
+		// Returns false if none of the packets has the id, or the packet was malformed
+		template <typename Handler>
+		static bool dispatch(packet_id id, detail::binary_serializer &s, Handler &&handler)
+		{
+			return dispatch_into(id, s, nullptr, handler);
+		}
+
+		// Decodes into the instance of the packet in into rather than a new one. Its strings
+		// and vectors keep their memory from packet to packet, so handlers living as long as
+		// their instances stop allocating once the instances grew large enough.
+		template <typename Handler>
+		static bool dispatch(packet_id id, detail::binary_serializer &s, instances &into, Handler &&handler)
+		{
+			return dispatch_into(id, s, &into, handler);
+		}
+
+	private:
+		static constexpr std::size_t size_ = std::max({std::size_t(Packets::id)...}) + 1;
+
+		static constexpr bool has_unique_ids()
+		{
+			std::array<packet_id, sizeof...(Packets)> ids = {Packets::id...};
+			std::sort(ids.begin(), ids.end());
+
+			return std::adjacent_find(ids.begin(), ids.end()) == ids.end();
+		}
+
+		static_assert(has_unique_ids(), "every packet in a packet_table needs an id of its own");
+
+		template <typename Handler>
+		static bool dispatch_into(packet_id id, detail::binary_serializer &s, instances *into, Handler &handler)
+		{
+			constexpr auto table = make_table<Handler>();
+
+			if (id >= table.size() || !table[id])
+				return false;
+
+			return table[id](s, into, handler);
+		}
+
+		template <typename Handler>
+		using entry = bool (*)(detail::binary_serializer &, instances *, Handler &);
+
+		template <typename Handler>
+		static constexpr std::array<entry<Handler>, size_> make_table()
+		{
+			std::array<entry<Handler>, size_> table = {};
+			((table[Packets::id] = &decode<Packets, Handler>), ...);
+
+			return table;
+		}
+
+		template <typename P, typename Handler>
+		static bool decode(detail::binary_serializer &s, instances *into, Handler &handler)
+		{
+			if (into)
+				return decode_into(std::get<P>(*into), s, handler);
+
+			P packet = {};
+			return decode_into(packet, s, handler);
+		}
+
+		template <typename P, typename Handler>
+		static bool decode_into(P &packet, detail::binary_serializer &s, Handler &handler)
+		{
+			packet.read(s);
+
+			if (s.has_failed())
+				return false;
+
+			handler(packet);
+			return true;
+		}
+	};
+} // namespace fi::packets
@@ -1,5 +1,6 @@
 #pragma once
 #include "packet_base.h"
+#include "packet_fields.h"
 
 /*
 	Allowed types for members:
@@ -21,43 +22,30 @@
 
 namespace fi::packets
 {
-	class example_packet : public base_packet
+	// Declares its fields once, serialize, deserialize and get_id are generated by packet
+	class example_packet : public packet<example_packet, ids::id_example>
 	{
 	public:
 		// If you want to, you can implement a custom constructor for your members,
 		// but it is not needed.
 		example_packet() {}
 
+		// Allocates the members anew for every packet read. Packets received
+		// over and over are better read into the same instance using read.
 		example_packet(detail::binary_serializer &s)
 		{
-			deserialize(s);
-		}
-
-		virtual void serialize(detail::binary_serializer &s)
-		{
-			// Serialize our items here
-			s.serialize(some_short);
-			s.serialize(some_array);
-			s.serialize(some_string_array);
-		}
-
-		virtual void deserialize(detail::binary_serializer &s)
-		{
-			// Deserialize our items here.
-			// IMPORTANT: Deserialize them in the same order you serialized them in!
-			s.deserialize(some_short);
-			s.deserialize(some_array);
-			s.deserialize(some_string_array);
-		}
-
-		virtual packet_id get_id()
-		{
-			return ids::id_example;
+			read(s);
 		}
 
 		// Make your members public to be able to access them.
 		std::uint16_t some_short = 0;
 		std::vector<std::uint8_t> some_array = {};
 		std::vector<std::string> some_string_array = {};
+
+		// The members which are sent, in the order they are (de-)serialized in
+		static constexpr auto fields = std::make_tuple(
+			&example_packet::some_short,
+			&example_packet::some_array,
+			&example_packet::some_string_array);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include "reassembly.h"
+
+#include <cstring>
+
+using namespace fi::detail;
+
+void reassembly_table::set_limits(std::size_t max_packet_length, std::size_t max_memory, std::chrono::milliseconds timeout)
+{
+	max_packet_length_ = max_packet_length;
+	max_memory_ = max_memory;
+	timeout_ = timeout;
+}
+
+reassembly_table::result reassembly_table::add(std::uint64_t sender, packets::packet_id id, const packets::fragment_header &fragment,
+											   const std::uint8_t *data, std::size_t length, std::chrono::steady_clock::time_point now)
+{
+	std::uint32_t packet_length = fragment.length;
+	std::uint16_t count = fragment.count, index = fragment.index;
+
+	// Every fragment holds at least a byte, and the sizes have to add up
+	if (!count || index >= count || packet_length < count || packet_length > max_packet_length_)
+		return result::rejected;
+
+	auto size = fragment_size(packet_length, count);
+
+	if (std::uint64_t(size) * (count - 1) >= packet_length)
+		return result::rejected;
+
+	auto expected = index == count - 1 ? packet_length - size * (count - 1) : size;
+
+	if (length != expected)
+		return result::rejected;
+
+	auto slot = find(sender, fragment.message);
+
+	if (slot == entries_.size())
+	{
+		slot = start(sender, fragment.message, id, fragment, now);
+
+		if (slot == entries_.size())
+			return result::rejected;
+	}
+
+	auto &packet = entries_[slot];
+
+	if (packet.id != id || packet.count != count || packet.length != packet_length)
+		return result::rejected;
+
+	auto &word = packet.received[index / 64];
+	auto bit = std::uint64_t(1) << (index % 64);
+
+	// A duplicate, e.g. resent by a reliable channel
+	if (word & bit)
+		return result::incomplete;
+
+	word |= bit;
+	memcpy(packet.data.data() + std::size_t(size) * index, data, length);
+
+	if (--packet.missing)
+		return result::incomplete;
+
+	completed_.swap(packet.data);
+	remove(slot);
+
+	return result::complete;
+}
+
+const fi::detail::pooled_bytes &reassembly_table::get_completed()
+{
+	return completed_;
+}
+
+void reassembly_table::expire(std::chrono::steady_clock::time_point now)
+{
+	for (std::size_t i = 0; i < entries_.size();)
+	{
+		if (entries_[i].deadline <= now)
+			remove(i);
+		else
+			i++;
+	}
+}
+
+void reassembly_table::clear()
+{
+	entries_.clear();
+	memory_ = 0;
+	last_used_ = 0;
+}
+
+std::size_t reassembly_table::find(std::uint64_t sender, std::uint32_t message)
+{
+	if (last_used_ < entries_.size() && entries_[last_used_].sender == sender && entries_[last_used_].message == message)
+		return last_used_;
+
+	for (std::size_t i = 0; i < entries_.size(); i++)
+	{
+		if (entries_[i].sender == sender && entries_[i].message == message)
+			return last_used_ = i;
+	}
+
+	return entries_.size();
+}
+
+std::size_t reassembly_table::start(std::uint64_t sender, std::uint32_t message, packets::packet_id id,
+									const packets::fragment_header &fragment, std::chrono::steady_clock::time_point now)
+{
+	std::size_t pending = 0, oldest = entries_.size();
+
+	for (std::size_t i = 0; i < entries_.size(); i++)
+	{
+		if (entries_[i].sender != sender)
+			continue;
+
+		pending++;
+
+		if (oldest == entries_.size() || entries_[i].deadline < entries_[oldest].deadline)
+			oldest = i;
+	}
+
+	// Most likely the sender already gave up on it, e.g. as it sends newer snapshots
+	if (pending >= max_per_sender)
+		remove(oldest);
+
+	if (memory_ + fragment.length > max_memory_)
+	{
+		expire(now);
+
+		if (memory_ + fragment.length > max_memory_)
+			return entries_.size();
+	}
+
+	auto &packet = entries_.emplace_back();
+
+	packet.data.resize(fragment.length);
+	packet.length = fragment.length;
+	packet.received.assign((fragment.count + 63) / 64, 0);
+	packet.deadline = now + timeout_;
+	packet.sender = sender;
+	packet.message = message;
+	packet.id = id;
+	packet.count = fragment.count;
+	packet.missing = fragment.count;
+
+	memory_ += fragment.length;
+
+	return last_used_ = entries_.size() - 1;
+}
+
+void reassembly_table::remove(std::size_t index)
+{
+	memory_ -= entries_[index].length;
+
+	// Order doesn't matter, the last entry takes its place
+	if (index != entries_.size() - 1)
+		entries_[index] = std::move(entries_.back());
+
+	entries_.pop_back();
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "../buffer_pool/buffer_pool.h"
+#include "../packets/packet_base.h"
+
+namespace fi::detail
+{
+	// The data of a packet is split into count fragments of this size, only the last one may be shorter
+	inline std::uint32_t fragment_size(std::uint32_t length, std::uint16_t count)
+	{
+		return (length + count - 1) / count;
+	}
+
+	// Puts packets split into fragments by the UDP talker back together. Every packet being
+	// put together takes memory for its whole length once its first fragment arrived, packets
+	// still missing fragments after the timeout are dropped. How much memory that takes is
+	// capped, as is the amount of packets a single sender can have being put together.
+	// Not thread safe.
+	class reassembly_table
+	{
+	public:
+		enum class result
+		{
+			incomplete, // Kept, the packet is still missing fragments
+			complete,	// The last fragment arrived, the packet is available using get_completed
+			rejected	// Malformed, or the packet would exceed a limit
+		};
+
+		void set_limits(std::size_t max_packet_length, std::size_t max_memory, std::chrono::milliseconds timeout);
+
+		// The data is that of the fragment, following its fragment header
+		result add(std::uint64_t sender, packets::packet_id id, const packets::fragment_header &fragment,
+				   const std::uint8_t *data, std::size_t length, std::chrono::steady_clock::time_point now);
+
+		// The data of the packet completed by the last add, valid until the next one
+		const pooled_bytes &get_completed();
+
+		// Drops packets which didn't get all of their fragments in time
+		void expire(std::chrono::steady_clock::time_point now);
+
+		void clear();
+
+		// Packets a single sender can have being put together, the oldest one is dropped for another
+		static constexpr std::size_t max_per_sender = 8;
+
+	private:
+		struct entry
+		{
+			pooled_bytes data = {};
+
+			// A bit for every fragment received
+			std::vector<std::uint64_t> received = {};
+
+			std::chrono::steady_clock::time_point deadline = {};
+			std::uint64_t sender = 0;
+			std::uint32_t message = 0, length = 0;
+			packets::packet_id id = 0;
+			std::uint16_t count = 0, missing = 0;
+		};
+
+		// Index of the entry of the packet, entries_.size() if there's none
+		std::size_t find(std::uint64_t sender, std::uint32_t message);
+
+		// Starts putting a packet together, returns entries_.size() if there's no room for it
+		std::size_t start(std::uint64_t sender, std::uint32_t message, packets::packet_id id,
+						  const packets::fragment_header &fragment, std::chrono::steady_clock::time_point now);
+
+		void remove(std::size_t index);
+
+		// Few packets are put together at once, and their fragments mostly arrive one after
+		// another, so a vector searched starting with the last packet used is fastest.
+		std::vector<entry> entries_ = {};
+		std::size_t last_used_ = 0;
+
+		pooled_bytes completed_ = {};
+
+		std::size_t memory_ = 0;
+
+		std::size_t max_packet_length_ = 1024 * 1024;
+		std::size_t max_memory_ = 16 * 1024 * 1024;
+		std::chrono::milliseconds timeout_ = std::chrono::seconds(1);
+	};
+} // namespace fi::detail
@@ -0,0 +1,246 @@
+#include "reliability.h"
+
+#include <algorithm>
+
+using namespace fi::detail;
+
+reliable_sender::reliable_sender(bool ordered) : ordered_(ordered), window_(ordered ? reorder_window : window_size)
+{
+}
+
+bool reliable_sender::can_send(std::size_t count)
+{
+	return std::uint16_t(next_ - oldest_) + count <= window_;
+}
+
+std::uint16_t reliable_sender::get_window()
+{
+	return window_;
+}
+
+std::uint16_t reliable_sender::get_next_sequence()
+{
+	return next_;
+}
+
+void reliable_sender::on_sent(pooled_bytes frame, reliable_clock::time_point now)
+{
+	auto &entry = entries_[next_ % window_size];
+
+	entry.frame = std::move(frame);
+	entry.sent_at = now;
+	entry.deadline = now + timeout_;
+	entry.sequence = next_;
+	entry.retries = 0;
+	entry.in_use = true;
+
+	next_deadline_ = std::min(next_deadline_, entry.deadline);
+
+	next_++;
+	stats_.sent++;
+}
+
+void reliable_sender::on_ack(std::uint16_t ack, std::uint32_t ack_bits, reliable_clock::time_point now)
+{
+	acknowledge(ack, now);
+
+	for (std::uint16_t i = 0; i < 32; i++)
+	{
+		if (ack_bits & (std::uint32_t(1) << i))
+			acknowledge(ack - i - 1, now);
+	}
+
+	advance_oldest();
+}
+
+reliable_clock::time_point reliable_sender::get_next_deadline()
+{
+	return next_deadline_;
+}
+
+fi::reliability_stats reliable_sender::get_stats()
+{
+	auto stats = stats_;
+	stats.rtt = std::chrono::duration_cast<std::chrono::microseconds>(smoothed_rtt_);
+
+	return stats;
+}
+
+void reliable_sender::acknowledge(std::uint16_t sequence, reliable_clock::time_point now)
+{
+	auto &entry = entries_[sequence % window_size];
+
+	if (!entry.in_use || entry.sequence != sequence)
+		return;
+
+	// Only packets sent once tell the round trip time, acks of resent
+	// ones may belong to any of the copies (Karn's algorithm).
+	if (!entry.retries)
+	{
+		auto rtt = now - entry.sent_at;
+
+		if (smoothed_rtt_ == reliable_clock::duration::zero())
+		{
+			smoothed_rtt_ = rtt;
+			rtt_variation_ = rtt / 2;
+		}
+		else
+		{
+			auto deviation = smoothed_rtt_ > rtt ? smoothed_rtt_ - rtt : rtt - smoothed_rtt_;
+
+			rtt_variation_ = (rtt_variation_ * 3 + deviation) / 4;
+			smoothed_rtt_ = (smoothed_rtt_ * 7 + rtt) / 8;
+		}
+
+		timeout_ = std::clamp(smoothed_rtt_ + rtt_variation_ * 4, min_timeout_, max_timeout_);
+	}
+
+	release(entry);
+}
+
+void reliable_sender::release(entry &entry)
+{
+	// Gives the frame back to the buffer pool
+	entry.frame = {};
+	entry.in_use = false;
+}
+
+void reliable_sender::advance_oldest()
+{
+	while (oldest_ != next_ && !entries_[oldest_ % window_size].in_use)
+		oldest_++;
+}
+
+reliable_clock::duration reliable_sender::backoff(std::uint8_t retries)
+{
+	auto timeout = timeout_;
+
+	for (std::uint8_t i = 0; i < retries && timeout < max_timeout_; i++)
+		timeout *= 2;
+
+	return std::min(timeout, max_timeout_);
+}
+
+reliable_receiver::reliable_receiver(bool ordered) : ordered_(ordered)
+{
+}
+
+reliable_receiver::result reliable_receiver::receive(std::uint16_t sequence)
+{
+	// Senders start counting at 0. A session started while its sender was already
+	// sending (e.g. after it expired) picks up at the first packet which arrives.
+	if (!started_)
+	{
+		started_ = true;
+
+		next_due_ = sequence < reorder_window ? 0 : sequence;
+		latest_ = next_due_ - 1;
+	}
+
+	if (!ordered_)
+	{
+		if (has_received(sequence))
+			return result::duplicate;
+
+		mark_received(sequence);
+		return result::deliver;
+	}
+
+	if (sequence_newer(next_due_, sequence))
+		return result::duplicate;
+
+	if (sequence == next_due_)
+	{
+		mark_received(sequence);
+		next_due_++;
+
+		return result::deliver;
+	}
+
+	if (std::uint16_t(sequence - next_due_) >= reorder_window)
+		return result::dropped;
+
+	if (has_received(sequence))
+		return result::duplicate;
+
+	mark_received(sequence);
+	return result::early;
+}
+
+void reliable_receiver::hold(std::uint16_t sequence, const packets::header &header, const std::uint8_t *data, std::size_t length)
+{
+	auto &held = held_[sequence % reorder_window];
+
+	held.data.assign(data, data + length);
+	held.header = header;
+	held.sequence = sequence;
+	held.in_use = true;
+}
+
+bool reliable_receiver::take_due(packets::header &header, pooled_bytes &data)
+{
+	auto &held = held_[next_due_ % reorder_window];
+
+	if (!held.in_use || held.sequence != next_due_)
+		return false;
+
+	header = held.header;
+	data.swap(held.data);
+
+	held.in_use = false;
+	next_due_++;
+
+	return true;
+}
+
+std::uint16_t reliable_receiver::get_latest()
+{
+	return latest_;
+}
+
+std::uint32_t reliable_receiver::get_ack_bits(std::uint16_t ack)
+{
+	std::uint32_t bits = 0;
+
+	for (std::uint16_t i = 0; i < 32; i++)
+	{
+		if (has_received(ack - i - 1))
+			bits |= std::uint32_t(1) << i;
+	}
+
+	return bits;
+}
+
+bool reliable_receiver::has_received(std::uint16_t sequence)
+{
+	if (sequence_newer(sequence, latest_))
+		return false;
+
+	// The sender only ever has a window of packets in flight, anything this
+	// old was acknowledged before, so it must have been received.
+	if (std::uint16_t(latest_ - sequence) >= history_size_)
+		return true;
+
+	return received_[sequence % history_size_];
+}
+
+void reliable_receiver::mark_received(std::uint16_t sequence)
+{
+	if (sequence_newer(sequence, latest_))
+	{
+		// Forget what we knew about the sequences the history moves past
+		std::uint16_t distance = sequence - latest_;
+
+		if (distance >= history_size_)
+			received_.reset();
+		else
+		{
+			for (std::uint16_t i = 1; i <= distance; i++)
+				received_[std::uint16_t(latest_ + i) % history_size_] = false;
+		}
+
+		latest_ = sequence;
+	}
+
+	received_[sequence % history_size_] = true;
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+
+#include "../buffer_pool/buffer_pool.h"
+#include "../packets/packet_base.h"
+
+namespace fi
+{
+	// How a packet sent by the UDP talker gets to the listener
+	enum class delivery : std::uint8_t
+	{
+		unreliable = 0,		// Sent once, may get lost, duplicated or reordered on the way
+		reliable_unordered, // Resent until acknowledged, handed over once, as soon as it arrives
+		reliable_ordered	// Like reliable_unordered, but handed over in the order it was sent in
+	};
+
+	struct reliability_stats
+	{
+		std::uint64_t sent = 0;
+		std::uint64_t retransmitted = 0;
+
+		// Packets given up on, as they weren't acknowledged after being resent max_retries
+		// times. Ordered channels never give up, as nothing sent after would be handed over.
+		std::uint64_t lost = 0;
+
+		// Smoothed round trip time, 0 until the first packet was acknowledged
+		std::chrono::microseconds rtt = {};
+	};
+} // namespace fi
+
+namespace fi::detail
+{
+	using reliable_clock = std::chrono::steady_clock;
+
+	// Packets an ordered channel holds on to at most while waiting for those sent before them
+	constexpr std::uint16_t reorder_window = 32;
+
+	// Whether sequence number a is newer than b, taking wrapping around into account
+	inline bool sequence_newer(std::uint16_t a, std::uint16_t b)
+	{
+		return a != b && std::uint16_t(a - b) < 0x8000;
+	}
+
+	// The sending side of a reliable channel. Keeps every packet sent until it is acknowledged,
+	// and resends it whenever its retransmit timeout runs out. The timeout is derived from the
+	// measured round trip time like TCP does (RFC 6298), and doubles with every retry.
+	// Not thread safe.
+	class reliable_sender
+	{
+	public:
+		// Packets in flight at most, no more are taken until the oldest one is acknowledged.
+		// Ordered channels only take as many as the receiver holds on to (reorder_window).
+		static constexpr std::uint16_t window_size = 256;
+		static constexpr std::uint8_t max_retries = 10;
+
+		explicit reliable_sender(bool ordered);
+
+		// Whether the channel takes count more packets right now
+		bool can_send(std::size_t count = 1);
+		std::uint16_t get_window();
+
+		std::uint16_t get_next_sequence();
+
+		// Takes the frame of the packet with the next sequence over, for resending it
+		void on_sent(pooled_bytes frame, reliable_clock::time_point now);
+
+		void on_ack(std::uint16_t ack, std::uint32_t ack_bits, reliable_clock::time_point now);
+
+		// Calls resend with the frame of every packet whose timeout ran out
+		template <typename F>
+		void retransmit(reliable_clock::time_point now, F &&resend)
+		{
+			if (now < next_deadline_)
+				return;
+
+			next_deadline_ = reliable_clock::time_point::max();
+
+			for (auto &entry : entries_)
+			{
+				if (!entry.in_use)
+					continue;
+
+				if (entry.deadline <= now)
+				{
+					if (!ordered_ && entry.retries == max_retries)
+					{
+						release(entry);
+						stats_.lost++;
+
+						continue;
+					}
+
+					resend(entry.frame);
+
+					entry.retries = std::min<std::uint8_t>(entry.retries + 1, max_retries);
+					entry.deadline = now + backoff(entry.retries);
+
+					stats_.retransmitted++;
+				}
+
+				next_deadline_ = std::min(next_deadline_, entry.deadline);
+			}
+
+			advance_oldest();
+		}
+
+		// When retransmit has to be called next, time_point::max() if nothing is in flight
+		reliable_clock::time_point get_next_deadline();
+
+		reliability_stats get_stats();
+
+	private:
+		struct entry
+		{
+			pooled_bytes frame = {};
+			reliable_clock::time_point sent_at = {}, deadline = {};
+
+			std::uint16_t sequence = 0;
+			std::uint8_t retries = 0;
+			bool in_use = false;
+		};
+
+		void acknowledge(std::uint16_t sequence, reliable_clock::time_point now);
+		void release(entry &entry);
+		void advance_oldest();
+
+		// The retransmit timeout after the given amount of retries
+		reliable_clock::duration backoff(std::uint8_t retries);
+
+		bool ordered_ = false;
+		std::uint16_t window_ = window_size;
+
+		// Indexed by the sequence modulo the window size
+		std::array<entry, window_size> entries_ = {};
+
+		// The oldest packet not acknowledged yet (next_ if there's none) and the next to send
+		std::uint16_t oldest_ = 0, next_ = 0;
+
+		reliable_clock::time_point next_deadline_ = reliable_clock::time_point::max();
+
+		static constexpr reliable_clock::duration min_timeout_ = std::chrono::milliseconds(10);
+		static constexpr reliable_clock::duration max_timeout_ = std::chrono::seconds(2);
+
+		// Used until the first round trip was measured
+		reliable_clock::duration timeout_ = std::chrono::milliseconds(200);
+		reliable_clock::duration smoothed_rtt_ = {}, rtt_variation_ = {};
+
+		reliability_stats stats_ = {};
+	};
+
+	// The receiving side of a reliable channel. Tracks which packets arrived for the acks and
+	// filters out duplicates. Ordered channels hold on to copies of packets which arrived early,
+	// until every packet sent before them arrived.
+	// Not thread safe.
+	class reliable_receiver
+	{
+	public:
+		enum class result
+		{
+			deliver,   // Hand the packet over now
+			duplicate, // Arrived before, acknowledge it again but don't hand it over
+			early,	   // Arrived ahead of the next one due, keep it using hold
+			dropped	   // Beyond the reorder window, don't acknowledge it
+		};
+
+		explicit reliable_receiver(bool ordered);
+
+		result receive(std::uint16_t sequence);
+
+		// Keeps a copy of a packet receive reported as early, the data follows its reliable header
+		void hold(std::uint16_t sequence, const packets::header &header, const std::uint8_t *data, std::size_t length);
+
+		// Takes the next packet held if it is due now. Call it after handing
+		// a packet over, until it returns false.
+		bool take_due(packets::header &header, pooled_bytes &data);
+
+		// The newest sequence received, and which of the 32 before the given one were received
+		std::uint16_t get_latest();
+		std::uint32_t get_ack_bits(std::uint16_t ack);
+
+	private:
+		// Enough to tell every packet of a full window of the sender apart
+		static constexpr std::uint16_t history_size_ = 256;
+
+		bool has_received(std::uint16_t sequence);
+		void mark_received(std::uint16_t sequence);
+
+		bool ordered_ = false;
+		bool started_ = false;
+
+		std::uint16_t latest_ = 0;
+		std::bitset<history_size_> received_ = {};
+
+		// The next packet to hand over on ordered channels
+		std::uint16_t next_due_ = 0;
+
+		struct held_packet
+		{
+			pooled_bytes data = {};
+			packets::header header = {};
+			std::uint16_t sequence = 0;
+			bool in_use = false;
+		};
+
+		// Indexed by the sequence modulo the reorder window
+		std::array<held_packet, reorder_window> held_ = {};
+	};
+} // namespace fi::detail
@@ -0,0 +1,70 @@
+#include "stream_buffer.h"
+
+#include <algorithm>
+
+using namespace fi::detail;
+
+std::uint8_t *stream_buffer::data()
+{
+	return buffer_.data() + read_offset_;
+}
+
+std::size_t stream_buffer::size()
+{
+	return write_offset_ - read_offset_;
+}
+
+void stream_buffer::consume(std::size_t length)
+{
+	read_offset_ += length;
+}
+
+std::uint8_t *stream_buffer::prepare(std::size_t min_length)
+{
+	// Start from the front again for free once everything was read
+	if (read_offset_ == write_offset_)
+		read_offset_ = write_offset_ = 0;
+
+	if (buffer_.size() - write_offset_ >= min_length)
+		return buffer_.data() + write_offset_;
+
+	auto unread = size();
+
+	// Only move the unread bytes to the front if we consumed at least as many
+	// bytes as we'd move, otherwise grow. This way every byte is moved a
+	// constant amount of times no matter how much data is backed up.
+	if (read_offset_ < unread || buffer_.size() - unread < min_length)
+		buffer_.resize(std::max(buffer_.size() * 2, unread + min_length));
+
+	if (read_offset_)
+	{
+		memmove(buffer_.data(), buffer_.data() + read_offset_, unread);
+
+		read_offset_ = 0;
+		write_offset_ = unread;
+	}
+
+	return buffer_.data() + write_offset_;
+}
+
+std::size_t stream_buffer::writable()
+{
+	return buffer_.size() - write_offset_;
+}
+
+void stream_buffer::commit(std::size_t length)
+{
+	write_offset_ += length;
+}
+
+void stream_buffer::append(const std::uint8_t *data, std::size_t length)
+{
+	memcpy(prepare(length), data, length);
+	commit(length);
+}
+
+void stream_buffer::clear()
+{
+	// Drops the unread bytes, prepare starts from the front again
+	read_offset_ = write_offset_;
+}
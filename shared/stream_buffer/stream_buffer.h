@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../buffer_pool/buffer_pool.h"
+
+namespace fi::detail
+{
+	// Holds a stream of received bytes. Consuming bytes only moves the read
+	// offset forward, the unread rest is moved to the front lazily once we
+	// run out of room at the back. That keeps consuming a packet O(1) while
+	// packets stay contiguous in memory. Only prepare moves the offsets back,
+	// so the room it returns stays in place while bytes are being consumed.
+	class stream_buffer
+	{
+	public:
+		// Unread bytes
+		std::uint8_t *data();
+		std::size_t size();
+
+		void consume(std::size_t length);
+
+		// Makes room for at least min_length bytes at the back and returns it,
+		// so data can be received into the buffer directly. Call commit with
+		// the amount of bytes actually written afterwards.
+		std::uint8_t *prepare(std::size_t min_length);
+		std::size_t writable();
+		void commit(std::size_t length);
+
+		void append(const std::uint8_t *data, std::size_t length);
+		void clear();
+
+	private:
+		pooled_bytes buffer_ = {};
+		std::size_t read_offset_ = 0, write_offset_ = 0;
+	};
+} // namespace fi::detail
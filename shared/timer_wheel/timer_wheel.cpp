@@ -0,0 +1,251 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace fi::detail;
+
+timer_wheel::timer_wheel() : timer_wheel(std::chrono::milliseconds(1))
+{
+}
+
+timer_wheel::timer_wheel(std::chrono::milliseconds tick) : tick_(tick)
+{
+	slots_.fill(none_);
+}
+
+timer_wheel::timer_id timer_wheel::schedule(std::chrono::milliseconds delay, std::function<void()> callback)
+{
+	std::uint32_t index = 0;
+
+	if (!free_timers_.empty())
+	{
+		index = free_timers_.back();
+		free_timers_.pop_back();
+	}
+	else
+	{
+		index = std::uint32_t(timers_.size());
+		timers_.emplace_back();
+	}
+
+	auto &t = timers_[index];
+
+	// Round up so a timer never runs early, the wheel may lag behind the clock though
+	auto elapsed = clock::now() + delay - origin_;
+	std::uint64_t deadline = (elapsed + tick_ - clock::duration(1)) / tick_;
+
+	t.deadline = std::max(deadline, current_tick_ + 1);
+	t.callback = std::move(callback);
+	t.active = true;
+
+	insert(index);
+	active_timers_++;
+
+	return (std::uint64_t(t.generation) << 32) | index;
+}
+
+bool timer_wheel::cancel(timer_id id)
+{
+	std::uint32_t index = std::uint32_t(id);
+	std::uint32_t generation = std::uint32_t(id >> 32);
+
+	if (index >= timers_.size())
+		return false;
+
+	auto &t = timers_[index];
+
+	if (!t.active || t.generation != generation)
+		return false;
+
+	if (t.slot != none_)
+		unlink(index);
+
+	release(index);
+	return true;
+}
+
+void timer_wheel::advance(clock::time_point now)
+{
+	std::uint64_t target = to_tick(now);
+
+	while (current_tick_ < target)
+	{
+		// Nothing could be due in between
+		if (!active_timers_)
+		{
+			current_tick_ = target;
+			break;
+		}
+
+		current_tick_++;
+
+		// Whenever a lower level wraps around, the next slot of the level above moves down
+		for (std::uint32_t level = 1; level < num_levels_; level++)
+		{
+			if (current_tick_ & ((1ull << (slot_bits_ * level)) - 1))
+				break;
+
+			cascade(level);
+		}
+
+		expire();
+	}
+}
+
+int timer_wheel::next_timeout(clock::time_point now)
+{
+	if (!active_timers_)
+		return -1;
+
+	std::uint64_t next = UINT64_MAX;
+
+	// The first occupied slot of every level tells when the wheel has something to do next,
+	// be it running a timer or moving timers down a level.
+	for (std::uint32_t level = 0; level < num_levels_; level++)
+	{
+		std::uint32_t shift = slot_bits_ * level;
+		std::uint64_t position = current_tick_ >> shift;
+
+		for (std::uint32_t i = 1; i <= num_slots_; i++)
+		{
+			if (slots_[level * num_slots_ + ((position + i) & slot_mask_)] != none_)
+			{
+				next = std::min(next, (position + i) << shift);
+				break;
+			}
+		}
+	}
+
+	auto until = origin_ + tick_ * next - now;
+
+	if (until <= clock::duration::zero())
+		return 0;
+
+	auto ms = std::chrono::ceil<std::chrono::milliseconds>(until).count();
+
+	return int(std::min<long long>(ms, INT_MAX));
+}
+
+std::size_t timer_wheel::size()
+{
+	return active_timers_;
+}
+
+std::uint64_t timer_wheel::to_tick(clock::time_point time)
+{
+	if (time <= origin_)
+		return 0;
+
+	return (time - origin_) / tick_;
+}
+
+void timer_wheel::insert(std::uint32_t index)
+{
+	auto &t = timers_[index];
+
+	// Timers moved down by a cascade may be due on the current tick,
+	// they are run right after by expire.
+	std::uint64_t delta = t.deadline > current_tick_ ? t.deadline - current_tick_ : 0;
+
+	// Park timers beyond the span of the wheel in the furthest slot
+	std::uint64_t span = 1ull << (slot_bits_ * num_levels_);
+	std::uint64_t target = current_tick_ + std::min(delta, span - 1);
+
+	std::uint32_t level = 0;
+
+	while (level < num_levels_ - 1 && std::min(delta, span - 1) >= (1ull << (slot_bits_ * (level + 1))))
+		level++;
+
+	std::uint32_t slot = level * num_slots_ + ((target >> (slot_bits_ * level)) & slot_mask_);
+
+	t.slot = slot;
+	t.prev = none_;
+	t.next = slots_[slot];
+
+	if (t.next != none_)
+		timers_[t.next].prev = index;
+
+	slots_[slot] = index;
+}
+
+void timer_wheel::unlink(std::uint32_t index)
+{
+	auto &t = timers_[index];
+
+	if (t.prev != none_)
+		timers_[t.prev].next = t.next;
+	else
+		slots_[t.slot] = t.next;
+
+	if (t.next != none_)
+		timers_[t.next].prev = t.prev;
+
+	t.slot = t.prev = t.next = none_;
+}
+
+void timer_wheel::release(std::uint32_t index)
+{
+	auto &t = timers_[index];
+
+	t.callback = {};
+	t.active = false;
+	t.generation++;
+
+	free_timers_.push_back(index);
+	active_timers_--;
+}
+
+void timer_wheel::take_slot(std::uint32_t slot, std::vector<timer_id> &ids)
+{
+	ids.clear();
+
+	for (auto index = slots_[slot]; index != none_;)
+	{
+		auto &t = timers_[index];
+		auto next = t.next;
+
+		ids.push_back((std::uint64_t(t.generation) << 32) | index);
+		t.slot = t.prev = t.next = none_;
+
+		index = next;
+	}
+
+	slots_[slot] = none_;
+}
+
+void timer_wheel::cascade(std::uint32_t level)
+{
+	take_slot(level * num_slots_ + ((current_tick_ >> (slot_bits_ * level)) & slot_mask_), due_);
+
+	for (auto id : due_)
+		insert(std::uint32_t(id));
+}
+
+void timer_wheel::expire()
+{
+	take_slot(current_tick_ & slot_mask_, due_);
+
+	for (std::size_t i = 0; i < due_.size(); i++)
+	{
+		std::uint32_t index = std::uint32_t(due_[i]);
+		auto &t = timers_[index];
+
+		// Cancelled by the callback of a timer before it
+		if (!t.active || t.generation != std::uint32_t(due_[i] >> 32))
+			continue;
+
+		// A parked timer which still isn't due
+		if (t.deadline > current_tick_)
+		{
+			insert(index);
+			continue;
+		}
+
+		auto callback = std::move(t.callback);
+		release(index);
+
+		// May schedule new timers, which never land in the slot we just emptied
+		callback();
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace fi::detail
+{
+	// Hierarchical timing wheel. Scheduling and cancelling a timer is O(1), and
+	// advancing the wheel only looks at the slots of the ticks which passed,
+	// no matter how many timers are scheduled.
+	// Timers further out than the wheel spans (about 4.6 hours with the default
+	// tick) are parked in the last slot and rescheduled once they come up.
+	// Not thread safe, a wheel is meant to be driven by a single thread.
+	class timer_wheel
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+
+		// 0 never refers to a timer
+		using timer_id = std::uint64_t;
+
+		// Ticks are a millisecond long by default
+		timer_wheel();
+		explicit timer_wheel(std::chrono::milliseconds tick);
+
+		timer_wheel(const timer_wheel &) = delete;
+		timer_wheel &operator=(const timer_wheel &) = delete;
+
+		// The callback runs from within advance once the delay has passed
+		timer_id schedule(std::chrono::milliseconds delay, std::function<void()> callback);
+
+		// Returns false if the timer already ran or was cancelled. Timers
+		// may be cancelled (and scheduled) from within a timer callback.
+		bool cancel(timer_id id);
+
+		// Runs the callbacks of every timer which is due by now
+		void advance(clock::time_point now);
+
+		// Milliseconds until the wheel needs advancing again, -1 if no timer is scheduled
+		int next_timeout(clock::time_point now);
+
+		std::size_t size();
+
+	private:
+		static constexpr std::uint32_t slot_bits_ = 6;
+		static constexpr std::uint32_t num_slots_ = 1 << slot_bits_;
+		static constexpr std::uint32_t slot_mask_ = num_slots_ - 1;
+		static constexpr std::uint32_t num_levels_ = 4;
+
+		// Marks the end of a slot's list or a timer which sits in no slot
+		static constexpr std::uint32_t none_ = ~0u;
+
+		struct timer
+		{
+			std::uint64_t deadline = 0;
+			std::function<void()> callback = {};
+
+			// Bumped whenever the timer is released, so stale ids don't match anymore
+			std::uint32_t generation = 1;
+
+			// Intrusive list of the slot the timer sits in
+			std::uint32_t slot = none_, prev = none_, next = none_;
+
+			bool active = false;
+		};
+
+		std::uint64_t to_tick(clock::time_point time);
+
+		void insert(std::uint32_t index);
+		void unlink(std::uint32_t index);
+		void release(std::uint32_t index);
+
+		// Takes the timers out of a slot, returning their ids
+		void take_slot(std::uint32_t slot, std::vector<timer_id> &ids);
+
+		// Moves the timers of a higher level slot down to where they belong now
+		void cascade(std::uint32_t level);
+
+		// Runs or reschedules the timers of the level 0 slot of the current tick
+		void expire();
+
+		std::chrono::milliseconds tick_;
+		clock::time_point origin_ = clock::now();
+
+		std::uint64_t current_tick_ = 0;
+		std::size_t active_timers_ = 0;
+
+		std::vector<timer> timers_ = {};
+		std::vector<std::uint32_t> free_timers_ = {};
+
+		// Head of the timer list of every slot, level by level
+		std::array<std::uint32_t, num_levels_ * num_slots_> slots_ = {};
+
+		// Reused while taking timers out of a slot
+		std::vector<timer_id> due_ = {};
+	};
+} // namespace fi::detail
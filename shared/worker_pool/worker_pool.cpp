@@ -0,0 +1,98 @@
+#include "worker_pool.h"
+
+using namespace fi::detail;
+
+worker_pool::~worker_pool()
+{
+	stop();
+}
+
+void worker_pool::start(std::size_t num_workers)
+{
+	std::lock_guard guard(mtx_);
+
+	if (running_)
+		return;
+
+	running_ = true;
+
+	for (std::size_t i = 0; i < num_workers; i++)
+		workers_.emplace_back(&worker_pool::run_worker, this);
+}
+
+void worker_pool::stop()
+{
+	{
+		std::lock_guard guard(mtx_);
+		running_ = false;
+	}
+
+	cv_.notify_all();
+
+	for (auto &worker : workers_)
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+
+	workers_.clear();
+}
+
+bool worker_pool::is_running()
+{
+	std::lock_guard guard(mtx_);
+	return running_;
+}
+
+void worker_pool::submit(std::uint64_t key, std::function<void()> job)
+{
+	{
+		std::lock_guard guard(mtx_);
+
+		auto &queue = queues_[key];
+		queue.push_back(std::move(job));
+
+		// The key is already waiting for or held by a worker
+		if (queue.size() > 1)
+			return;
+
+		ready_keys_.push_back(key);
+	}
+
+	cv_.notify_one();
+}
+
+void worker_pool::run_worker()
+{
+	std::unique_lock lock(mtx_);
+
+	while (true)
+	{
+		cv_.wait(lock, [this]
+				 { return !running_ || !ready_keys_.empty(); });
+
+		// Only exit once everything queued has been run
+		if (ready_keys_.empty())
+			break;
+
+		auto key = ready_keys_.front();
+		ready_keys_.pop_front();
+
+		// The job stays at the front of its queue while running,
+		// so submitting to the key doesn't make it ready again.
+		auto job = std::move(queues_[key].front());
+
+		lock.unlock();
+		job();
+		lock.lock();
+
+		auto &queue = queues_[key];
+		queue.pop_front();
+
+		// Put the key at the back, so keys with many jobs don't starve the others
+		if (queue.empty())
+			queues_.erase(key);
+		else
+			ready_keys_.push_back(key);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <condition_variable>
+
+namespace fi::detail
+{
+	// Runs jobs on a fixed amount of threads. Jobs submitted with the same key
+	// form a serial queue: they run one after another in the order they were
+	// submitted, while jobs of different keys run in parallel.
+	class worker_pool
+	{
+	public:
+		worker_pool() = default;
+		~worker_pool();
+
+		void start(std::size_t num_workers);
+
+		// Finishes every job queued so far, then joins the workers
+		void stop();
+
+		bool is_running();
+
+		void submit(std::uint64_t key, std::function<void()> job);
+
+	private:
+		void run_worker();
+
+		bool running_ = false;
+
+		std::mutex mtx_ = {};
+		std::condition_variable cv_ = {};
+
+		// Pending jobs per key. A key is in ready_keys_ (or being worked on) as
+		// long as it has jobs, which keeps two workers from running the same key.
+		std::unordered_map<std::uint64_t, std::deque<std::function<void()>>> queues_ = {};
+		std::deque<std::uint64_t> ready_keys_ = {};
+
+		std::vector<std::thread> workers_ = {};
+	};
+} // namespace fi::detail
@@ -1,5 +1,10 @@
 #include "async_talker.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include <poll.h>
+
 using namespace fi;
 
 fi::async_udp_talker::async_udp_talker()
@@ -9,6 +14,11 @@ fi::async_udp_talker::async_udp_talker()
 
 fi::async_udp_talker::~async_udp_talker()
 {
+    stop_reliability();
+
+    if (mtu_socket_ != -1)
+        close(mtu_socket_);
+
     if (dest != nullptr)
         freeaddrinfo(dest);
     // do windows stuff
@@ -16,6 +26,14 @@ fi::async_udp_talker::~async_udp_talker()
 
 void fi::async_udp_talker::set_destination(std::string_view ip, std::string_view port)
 {
+    // The thread uses the socket, and the listener at the new destination knows nothing of our packets
+    stop_reliability();
+
+    {
+        std::lock_guard guard(reliable_mtx_);
+        reliable_senders_ = {detail::reliable_sender(false), detail::reliable_sender(true)};
+    }
+
     if (dest != nullptr)
         freeaddrinfo(dest);
 
@@ -36,40 +54,638 @@ void fi::async_udp_talker::set_destination(std::string_view ip, std::string_view
         throw exception(exception::reason_id::socket_failure, "async_tcp_client::connect: failed to create socket");
     }
 
+    // Kernels knowing UDP_SEGMENT accept it, a segment size of 0 leaves plain sends as they are
+    int segment_size = 0;
+    segmentation_offload_ = setsockopt(socket_, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+
+    // The kernel only tells connected sockets the path MTU it learned, while ours stays unconnected so
+    // it doesn't report errors of earlier datagrams. Without it, packets are split at max_datagram_size_.
+    if (mtu_socket_ != -1)
+        close(mtu_socket_);
+
+    mtu_socket_ = ::socket(dest->ai_family, dest->ai_socktype, dest->ai_protocol);
+
+    if (mtu_socket_ != -1 && connect(mtu_socket_, dest->ai_addr, dest->ai_addrlen) == -1)
+    {
+        close(mtu_socket_);
+        mtu_socket_ = -1;
+    }
+
+    path_mtu_ = 0;
+    path_mtu_checked_ = {};
+
     // freeaddrinfo(result); // do not free
 }
 
-void fi::async_udp_talker::send_packet(packets::base_packet *const packet)
+bool fi::async_udp_talker::send_packet(packets::base_packet *const packet, delivery mode)
 {
     if (!packet)
         throw exception(exception::reason_id::packet_nullptr, "async_udp_talker::send_packet: packet was nullptr");
 
     std::lock_guard guard(send_mtx_);
 
-    serializer.reset();
+    // Larger packets are split into datagrams the path takes without IP fragmentation
+    datagram_limit_ = get_datagram_limit();
 
-    // Serialize our data
+    if (mode == delivery::unreliable)
+    {
+        // Leave room for the header, the serialized buffer is the packet as it goes out
+        serializer.reserve_header(sizeof(packets::header));
+
+        // Serialize our data
+        packet->serialize(serializer);
+
+        // Construct our packet header
+        packets::header packet_header = construct_packet_header(
+            serializer.get_serialized_data_length(),
+            packet->get_id(),
+            packets::flags::fl_none);
+
+        serializer.write_header(packet_header);
+
+        // Attempt to send the packet
+        if (serializer.get_frame_length() <= datagram_limit_)
+            return send_packet_internal(serializer.get_frame_data(), serializer.get_frame_length());
+
+        frame_offsets_.assign({0, serializer.get_frame_length()});
+        return send_frames(1) == 1;
+    }
+
+    std::lock_guard reliable_guard(reliable_mtx_);
+
+    auto &sender = reliable_senders_[std::uint8_t(mode) - 1];
+
+    if (!sender.can_send())
+        return false;
+
+    serializer.reserve_header(sizeof(packets::header) + sizeof(packets::reliable_header));
     packet->serialize(serializer);
 
-    // Allocate a buffer for our packet
-    std::vector<std::uint8_t> packet_data(sizeof(packets::header) + serializer.get_serialized_data_length());
+    if (serializer.get_frame_length() > datagram_limit_)
+    {
+        if (!send_reliable_fragments(sender, std::uint8_t(mode), packet->get_id()))
+            return false;
+    }
+    else
+    {
+        packets::header packet_header = construct_packet_header(
+            serializer.get_serialized_data_length() + sizeof(packets::reliable_header),
+            packet->get_id(),
+            packets::flags::fl_reliable);
+
+        // Nothing is received over these channels, so there's nothing to acknowledge
+        packets::reliable_header reliable_header = {};
+
+        reliable_header.channel = std::uint8_t(mode);
+        reliable_header.sequence = sender.get_next_sequence();
+
+        serializer.write_header(packet_header);
+        memcpy(serializer.get_frame_data() + sizeof(packets::header), &reliable_header, sizeof(packets::reliable_header));
+
+        // If this fails the packet goes out again once its timeout ran out
+        send_packet_internal(serializer.get_frame_data(), serializer.get_frame_length());
+
+        // The frame is kept until it's acknowledged, the serializer gets a new buffer from the pool
+        sender.on_sent(serializer.take_frame(), detail::reliable_clock::now());
+    }
+
+    if (!reliability_running_)
+    {
+        if (reliability_thread_.joinable())
+            reliability_thread_.join();
+
+        reliability_running_ = true;
+        reliability_thread_ = std::thread(&async_udp_talker::run_reliability, this);
+    }
+
+    return true;
+}
+
+std::size_t fi::async_udp_talker::send_batch(std::span<packets::base_packet *const> packets)
+{
+    for (auto packet : packets)
+    {
+        if (!packet)
+            throw exception(exception::reason_id::packet_nullptr, "async_udp_talker::send_batch: packet was nullptr");
+    }
+
+    std::lock_guard guard(send_mtx_);
+
+    datagram_limit_ = get_datagram_limit();
+
+    std::size_t sent = 0;
+
+    while (sent < packets.size())
+    {
+        auto batch = packets.subspan(sent, std::min(packets.size() - sent, batch_size_));
+
+        // Serialize the whole batch back to back into a single buffer, every packet with its header
+        serializer.reset();
+        frame_offsets_.clear();
+
+        for (auto packet : batch)
+        {
+            auto offset = serializer.get_frame_length();
+
+            serializer.append_bytes(sizeof(packets::header));
+            packet->serialize(serializer);
+
+            auto header = construct_packet_header(
+                serializer.get_frame_length() - offset - sizeof(packets::header),
+                packet->get_id(),
+                packets::flags::fl_none);
+
+            memcpy(serializer.get_frame_data() + offset, &header, sizeof(packets::header));
+
+            frame_offsets_.push_back(offset);
+        }
+
+        // The buffer is complete now, it doesn't move anymore
+        frame_offsets_.push_back(serializer.get_frame_length());
+
+        auto batch_sent = send_frames(batch.size());
+        sent += batch_sent;
+
+        if (batch_sent < batch.size())
+            break;
+    }
+
+    return sent;
+}
+
+bool fi::async_udp_talker::has_segmentation_offload()
+{
+    return segmentation_offload_;
+}
+
+fi::reliability_stats fi::async_udp_talker::get_reliability_stats(delivery mode)
+{
+    if (mode == delivery::unreliable)
+        return {};
+
+    std::lock_guard guard(reliable_mtx_);
+    return reliable_senders_[std::uint8_t(mode) - 1].get_stats();
+}
+
+void fi::async_udp_talker::set_max_datagram_size(std::size_t size)
+{
+    std::lock_guard guard(send_mtx_);
+    max_datagram_size_ = std::clamp(size, min_datagram_size_, std::size_t(PACKET_BUFFER_SIZE));
+}
+
+std::size_t fi::async_udp_talker::get_datagram_limit()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    // Routers on the way tell the kernel once datagrams are too large for them, which takes
+    // a while to show up. Asking for every packet would cost a system call each.
+    if (mtu_socket_ != -1 && now - path_mtu_checked_ >= path_mtu_interval_)
+    {
+        int mtu = 0;
+        socklen_t length = sizeof(mtu);
+
+        if (getsockopt(mtu_socket_, IPPROTO_IP, IP_MTU, &mtu, &length) == 0)
+            path_mtu_ = mtu;
+
+        path_mtu_checked_ = now;
+    }
+
+    auto limit = max_datagram_size_;
+
+    // Less the IPv4 and UDP headers
+    if (path_mtu_ > udp_overhead_)
+        limit = std::min(limit, path_mtu_ - udp_overhead_);
+
+    return std::max(limit, min_datagram_size_);
+}
+
+std::size_t fi::async_udp_talker::frame_length(std::size_t frame)
+{
+    return frame_offsets_[frame + 1] - frame_offsets_[frame];
+}
+
+std::size_t fi::async_udp_talker::fragment_count(std::size_t frame_length)
+{
+    if (frame_length <= datagram_limit_)
+        return 1;
+
+    auto fragment_data = datagram_limit_ - sizeof(packets::header) - sizeof(packets::fragment_header);
+    return (frame_length - sizeof(packets::header) + fragment_data - 1) / fragment_data;
+}
+
+std::size_t fi::async_udp_talker::send_frames(std::size_t frame_count)
+{
+    std::size_t sent = 0;
+
+    // Numbered once up front, a frame sent again after a failed attempt keeps its number.
+    // The listener then completes the packet from the fragments of both attempts.
+    frame_messages_.resize(frame_count);
+
+    for (std::size_t i = 0; i < frame_count; i++)
+    {
+        if (fragment_count(frame_length(i)) > 1)
+            frame_messages_[i] = next_message_++;
+    }
+
+    while (sent < frame_count)
+    {
+        bool segmented = segmentation_offload_;
+        auto count = segmented ? prepare_segmented(frame_count - sent) : prepare_datagrams(frame_count - sent);
+
+        auto messages_sent = send_messages(count);
+
+        std::size_t frames_sent = 0;
+
+        for (std::size_t i = 0; i < messages_sent; i++)
+            frames_sent += message_frames_[i];
+
+        sent += frames_sent;
+
+        if (messages_sent == count)
+            break;
+
+        // The route can't take segmented buffers (e.g. the device can't checksum them),
+        // send the frames left and everything after them as plain datagrams.
+        if (segmented && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            segmentation_offload_ = false;
+
+            // The offsets are into the buffer, the ones left stay valid
+            frame_offsets_.erase(frame_offsets_.begin(), frame_offsets_.begin() + frames_sent);
+            frame_messages_.erase(frame_messages_.begin(), frame_messages_.begin() + frames_sent);
+            continue;
+        }
+
+        break;
+    }
+
+    return sent;
+}
+
+void fi::async_udp_talker::reserve_messages(std::size_t frame_count)
+{
+    std::size_t messages = 0, iovecs = 0, fragments = 0;
+
+    // At most a message per frame, and one per fragment of those split up
+    for (std::size_t i = 0; i < frame_count; i++)
+    {
+        auto count = fragment_count(frame_length(i));
+
+        if (count > std::numeric_limits<std::uint16_t>::max())
+            throw exception(exception::reason_id::packet_too_large, "async_udp_talker::send_packet: packet takes more than 65535 fragments");
+
+        messages += count;
+        iovecs += count > 1 ? count * 2 : 1;
+        fragments += count > 1 ? count : 0;
+    }
+
+    messages_.resize(messages);
+    iovecs_.resize(iovecs);
+    controls_.resize(messages);
+    message_frames_.resize(messages);
+
+    // The iovecs point into it, it mustn't reallocate while being filled
+    fragment_headers_.clear();
+    fragment_headers_.reserve(fragments);
+}
+
+void fi::async_udp_talker::add_message(std::size_t message, std::size_t first_iovec, std::size_t iovec_count, std::uint32_t frames)
+{
+    auto &header = messages_[message];
+
+    header = {};
+    header.msg_hdr.msg_iov = &iovecs_[first_iovec];
+    header.msg_hdr.msg_iovlen = iovec_count;
+    header.msg_hdr.msg_name = dest->ai_addr;
+    header.msg_hdr.msg_namelen = dest->ai_addrlen;
+
+    message_frames_[message] = frames;
+}
+
+void fi::async_udp_talker::set_segment_size(std::size_t message, std::size_t segment_size)
+{
+    auto &header = messages_[message].msg_hdr;
+
+    header.msg_control = controls_[message].data();
+    header.msg_controllen = controls_[message].size();
+
+    auto control = CMSG_FIRSTHDR(&header);
+
+    control->cmsg_level = SOL_UDP;
+    control->cmsg_type = UDP_SEGMENT;
+    control->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+
+    std::uint16_t size = segment_size;
+    memcpy(CMSG_DATA(control), &size, sizeof(size));
+}
+
+void fi::async_udp_talker::add_fragments(std::size_t frame, bool segmented, std::size_t &message, std::size_t &iovec)
+{
+    auto data = serializer.get_frame_data() + frame_offsets_[frame];
+
+    packets::header header = {};
+    memcpy(&header, data, sizeof(packets::header));
+
+    auto payload = data + sizeof(packets::header);
+    std::uint32_t payload_length = frame_length(frame) - sizeof(packets::header);
+
+    std::uint16_t count = fragment_count(frame_length(frame));
+    auto size = detail::fragment_size(payload_length, count);
+
+    // The fragments only differ in their headers, which go out from a buffer of their own
+    packets::fragment_header fragment = {};
+
+    fragment.message = frame_messages_[frame];
+    fragment.count = count;
+    fragment.length = payload_length;
+
+    // Fragments are of the same size, so they are segmented by the kernel as well
+    auto segment_size = sizeof(packets::header) + sizeof(packets::fragment_header) + size;
+    std::size_t per_message = 1;
+
+    if (segmented && segment_size <= max_segment_size_)
+        per_message = std::clamp<std::size_t>(max_segmented_length_ / segment_size, 1, batch_size_);
+
+    for (std::uint16_t index = 0; index < count;)
+    {
+        auto first_iovec = iovec;
+        auto fragments = std::min<std::size_t>(per_message, count - index);
+
+        for (std::size_t i = 0; i < fragments; i++, index++)
+        {
+            std::uint32_t length = index == count - 1 ? payload_length - size * index : size;
+
+            auto fragment_header = construct_packet_header(
+                sizeof(packets::fragment_header) + length,
+                header.id,
+                packets::packet_flags(header.flags | packets::flags::fl_fragment));
+
+            fragment.index = index;
+
+            auto &prefix = fragment_headers_.emplace_back();
+
+            memcpy(prefix.data(), &fragment_header, sizeof(packets::header));
+            memcpy(prefix.data() + sizeof(packets::header), &fragment, sizeof(packets::fragment_header));
+
+            iovecs_[iovec].iov_base = prefix.data();
+            iovecs_[iovec++].iov_len = prefix.size();
+
+            iovecs_[iovec].iov_base = payload + std::size_t(size) * index;
+            iovecs_[iovec++].iov_len = length;
+        }
+
+        // The packet counts as sent once its last fragment is
+        add_message(message, first_iovec, iovec - first_iovec, index == count ? 1 : 0);
 
-    // Construct our packet header
-    packets::header packet_header = construct_packet_header(
-        serializer.get_serialized_data_length(),
-        packet->get_id(),
-        packets::flags::fl_none);
+        if (fragments > 1)
+            set_segment_size(message, segment_size);
 
-    // Write our packet into the buffer
-    memcpy(packet_data.data(), &packet_header, sizeof(packets::header));
+        message++;
+    }
+}
+
+bool fi::async_udp_talker::send_reliable_fragments(detail::reliable_sender &sender, std::uint8_t channel, packets::packet_id id)
+{
+    constexpr std::size_t headers_length = sizeof(packets::header) + sizeof(packets::reliable_header) + sizeof(packets::fragment_header);
+
+    std::uint32_t payload_length = serializer.get_serialized_data_length();
+
+    auto fragment_data = datagram_limit_ - headers_length;
+    auto count = (payload_length + fragment_data - 1) / fragment_data;
+
+    // Every fragment is a packet of the channel, acknowledged and resent on its own
+    if (count > sender.get_window())
+        throw exception(exception::reason_id::packet_too_large, "async_udp_talker::send_packet: packet takes more fragments than the channel has in flight");
+
+    if (!sender.can_send(count))
+        return false;
+
+    auto size = detail::fragment_size(payload_length, count);
+    auto payload = serializer.get_frame_data() + sizeof(packets::header) + sizeof(packets::reliable_header);
+
+    packets::reliable_header reliable_header = {};
+    packets::fragment_header fragment = {};
+
+    reliable_header.channel = channel;
+
+    fragment.message = next_message_++;
+    fragment.count = count;
+    fragment.length = payload_length;
+
+    auto now = detail::reliable_clock::now();
+
+    for (std::uint16_t index = 0; index < count; index++)
+    {
+        std::uint32_t length = index == count - 1 ? payload_length - size * index : size;
+
+        auto header = construct_packet_header(
+            sizeof(packets::reliable_header) + sizeof(packets::fragment_header) + length,
+            id,
+            packets::flags::fl_reliable | packets::flags::fl_fragment);
 
-    memcpy(
-        packet_data.data() + sizeof(packets::header),
-        serializer.get_serialized_data(),
-        serializer.get_serialized_data_length());
+        reliable_header.sequence = sender.get_next_sequence();
+        fragment.index = index;
+
+        // Each is kept on its own until it's acknowledged
+        detail::pooled_bytes frame(headers_length + length);
+
+        memcpy(frame.data(), &header, sizeof(packets::header));
+        memcpy(frame.data() + sizeof(packets::header), &reliable_header, sizeof(packets::reliable_header));
+        memcpy(frame.data() + sizeof(packets::header) + sizeof(packets::reliable_header), &fragment, sizeof(packets::fragment_header));
+        memcpy(frame.data() + headers_length, payload + std::size_t(size) * index, length);
+
+        send_packet_internal(frame.data(), frame.size());
+        sender.on_sent(std::move(frame), now);
+    }
+
+    return true;
+}
+
+std::size_t fi::async_udp_talker::prepare_datagrams(std::size_t frame_count)
+{
+    reserve_messages(frame_count);
+
+    std::size_t message = 0, iovec = 0;
+
+    for (std::size_t i = 0; i < frame_count; i++)
+    {
+        if (frame_length(i) > datagram_limit_)
+        {
+            add_fragments(i, false, message, iovec);
+            continue;
+        }
+
+        iovecs_[iovec].iov_base = serializer.get_frame_data() + frame_offsets_[i];
+        iovecs_[iovec].iov_len = frame_length(i);
+
+        add_message(message++, iovec++, 1, 1);
+    }
+
+    return message;
+}
+
+std::size_t fi::async_udp_talker::prepare_segmented(std::size_t frame_count)
+{
+    reserve_messages(frame_count);
+
+    // Segments have to fit the path as well
+    auto largest_segment = std::min(max_segment_size_, datagram_limit_);
+
+    std::size_t message = 0, iovec = 0;
+
+    for (std::size_t first = 0; first < frame_count;)
+    {
+        if (frame_length(first) > datagram_limit_)
+        {
+            add_fragments(first++, true, message, iovec);
+            continue;
+        }
+
+        // Frames lie back to back, so frames of the same size following each other form
+        // a single buffer. The kernel splits it into segments of that size, with only the
+        // last segment allowed to be shorter.
+        auto segment_size = frame_length(first);
+        auto last = first + 1;
+
+        if (segment_size <= largest_segment)
+        {
+            while (last < frame_count && frame_length(last) == segment_size && (last - first + 1) * segment_size <= max_segmented_length_)
+                last++;
+
+            if (last < frame_count && last > first + 1 && frame_length(last) < segment_size && (last - first) * segment_size + frame_length(last) <= max_segmented_length_)
+                last++;
+        }
+
+        iovecs_[iovec].iov_base = serializer.get_frame_data() + frame_offsets_[first];
+        iovecs_[iovec].iov_len = frame_offsets_[last] - frame_offsets_[first];
+
+        add_message(message, iovec++, 1, last - first);
+
+        // A single frame is sent as it is
+        if (last - first > 1)
+            set_segment_size(message, segment_size);
+
+        message++;
+        first = last;
+    }
+
+    return message;
+}
+
+std::size_t fi::async_udp_talker::send_messages(std::size_t count)
+{
+    std::size_t sent = 0;
+
+    // The kernel may take fewer datagrams than given, e.g. when interrupted
+    while (sent < count)
+    {
+        int result = sendmmsg(socket_, messages_.data() + sent, count - sent, 0);
+
+        if (result == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        sent += result;
+    }
+
+    return sent;
+}
+
+void fi::async_udp_talker::run_reliability()
+{
+    while (reliability_running_)
+    {
+        auto now = detail::reliable_clock::now();
+        auto wake_up = now + reliability_interval_;
+
+        {
+            std::lock_guard guard(reliable_mtx_);
+
+            for (auto &sender : reliable_senders_)
+                wake_up = std::min(wake_up, sender.get_next_deadline());
+        }
+
+        // Rounded up, waking up before the deadline would only mean waiting again
+        auto timeout = std::chrono::ceil<std::chrono::milliseconds>(std::max(wake_up - now, detail::reliable_clock::duration::zero()));
+
+        pollfd descriptor = {};
+
+        descriptor.fd = socket_;
+        descriptor.events = POLLIN;
+
+        if (poll(&descriptor, 1, int(timeout.count())) > 0 && (descriptor.revents & POLLIN))
+            receive_acks();
+
+        std::lock_guard guard(reliable_mtx_);
+
+        now = detail::reliable_clock::now();
+
+        for (auto &sender : reliable_senders_)
+        {
+            sender.retransmit(now, [this](const detail::pooled_bytes &frame)
+                              { send_packet_internal(frame.data(), frame.size()); });
+        }
+    }
+}
+
+void fi::async_udp_talker::receive_acks()
+{
+    std::array<std::uint8_t, 2048> buffer = {};
+
+    // Takes everything queued, without waiting for more
+    while (true)
+    {
+        sockaddr_storage address = {};
+        socklen_t address_length = sizeof(address);
+
+        auto received = recvfrom(socket_, buffer.data(), buffer.size(), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&address), &address_length);
+
+        if (received < 0)
+            return;
+
+        // Only the listener we send to acknowledges our packets
+        auto from = reinterpret_cast<const sockaddr_in *>(&address);
+        auto to = reinterpret_cast<const sockaddr_in *>(dest->ai_addr);
+
+        if (from->sin_family != to->sin_family || from->sin_port != to->sin_port || from->sin_addr.s_addr != to->sin_addr.s_addr)
+            continue;
+
+        auto now = detail::reliable_clock::now();
+
+        std::lock_guard guard(reliable_mtx_);
+
+        // A datagram may hold several acks, e.g. for packets far apart
+        for (std::size_t offset = 0; offset + sizeof(packets::header) + sizeof(packets::reliable_header) <= std::size_t(received);
+             offset += sizeof(packets::header) + sizeof(packets::reliable_header))
+        {
+            packets::header header = {};
+            packets::reliable_header ack = {};
+
+            memcpy(&header, buffer.data() + offset, sizeof(packets::header));
+            memcpy(&ack, buffer.data() + offset + sizeof(packets::header), sizeof(packets::reliable_header));
+
+            if (header.magic != PACKET_MAGIC || !(header.flags & packets::flags::fl_ack) ||
+                header.length != sizeof(packets::header) + sizeof(packets::reliable_header))
+                break;
+
+            if (ack.channel != std::uint8_t(delivery::reliable_unordered) && ack.channel != std::uint8_t(delivery::reliable_ordered))
+                break;
+
+            reliable_senders_[ack.channel - 1].on_ack(ack.ack, ack.ack_bits, now);
+        }
+    }
+}
+
+void fi::async_udp_talker::stop_reliability()
+{
+    reliability_running_ = false;
 
-    // Attempt to send the packet
-    send_packet_internal(packet_data.data(), packet_data.size());
+    if (reliability_thread_.joinable())
+        reliability_thread_.join();
 }
 
 packets::header fi::async_udp_talker::construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags)
@@ -84,14 +700,14 @@ packets::header fi::async_udp_talker::construct_packet_header(packets::packet_le
     return packet_header;
 }
 
-bool fi::async_udp_talker::send_packet_internal(void *const data, const packets::packet_length length)
+bool fi::async_udp_talker::send_packet_internal(const void *const data, const packets::packet_length length)
 {
     std::uint32_t bytes_sent = 0;
     do
     {
         int sent = sendto(
             socket_,
-            reinterpret_cast<char *>(data) + bytes_sent,
+            reinterpret_cast<const char *>(data) + bytes_sent,
             length - bytes_sent,
             0,
             dest->ai_addr, dest->ai_addrlen);
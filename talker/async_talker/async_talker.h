@@ -19,6 +19,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 
 #else
 #error OS unknown or not supported.
@@ -26,13 +27,20 @@
 
 #pragma endregion os_dependent_includes
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <limits>
 #include <mutex>
+#include <span>
 #include <thread>
 #include <vector>
 #include <functional>
 #include <unordered_map>
 
 #include "../../shared/packets/packets.h"
+#include "../../shared/reassembly/reassembly.h"
+#include "../../shared/reliability/reliability.h"
 
 namespace fi
 {
@@ -44,19 +52,144 @@ namespace fi
         async_udp_talker();
         ~async_udp_talker();
 
+        // Changing the destination starts the reliable channels over
         void set_destination(std::string_view ip, std::string_view port);
-        void send_packet(packets::base_packet *const packet);
 
+        // Packets which don't fit a datagram of this size (default 1472 bytes, which fits ethernet)
+        // are split into fragments, which the listener puts back together. Smaller datagrams are
+        // used once the kernel learned a smaller MTU for the path. At most PACKET_BUFFER_SIZE,
+        // as the listener receives datagrams into buffers of that size.
+        void set_max_datagram_size(std::size_t size);
+
+        // Reliable packets are kept and resent until the listener acknowledges them, which a thread
+        // started with the first of them takes care of. Returns false if the packet wasn't taken,
+        // as the channel already has as many packets in flight as it takes (reliable_sender::window_size,
+        // detail::reorder_window for ordered ones). Each fragment of a reliable packet counts
+        // as a packet of its own.
+        bool send_packet(packets::base_packet *const packet, delivery mode = delivery::unreliable);
+
+        // Sends every packet as a datagram of its own, handing them to the kernel
+        // in batches. Returns the amount of packets sent, which is less than the
+        // amount given if sending failed part way.
+        // Where the kernel supports it, packets of the same size following each other
+        // are handed over as a single buffer, which the kernel splits into datagrams.
+        std::size_t send_batch(std::span<packets::base_packet *const> packets);
+
+        // Whether send_batch hands packets to the kernel using segmentation offload
+        bool has_segmentation_offload();
+
+        reliability_stats get_reliability_stats(delivery mode);
+
+    private:
         packets::header construct_packet_header(packets::packet_length length, packets::packet_id id, packets::packet_flags flags);
 
         // Function for sending our packet
-        bool send_packet_internal(void *const data, const packets::packet_length length);
+        bool send_packet_internal(const void *const data, const packets::packet_length length);
+
+        // Set up messages_ for the frames serialized, returns the amount of messages
+        std::size_t prepare_datagrams(std::size_t frame_count);
+        std::size_t prepare_segmented(std::size_t frame_count);
+
+        // Sends the messages set up, returns how many of them were sent
+        std::size_t send_messages(std::size_t count);
+
+        // Sends the frames serialized, returns how many of them were sent
+        std::size_t send_frames(std::size_t frame_count);
+
+        // The largest datagram to send, the smaller of max_datagram_size_ and what the path takes
+        std::size_t get_datagram_limit();
+
+        std::size_t frame_length(std::size_t frame);
+
+        // Datagrams it takes to send a frame, 1 if it doesn't have to be split
+        std::size_t fragment_count(std::size_t frame_length);
+
+        // Makes room for the messages, iovecs and fragment headers the frames take at most
+        void reserve_messages(std::size_t frame_count);
+        void add_message(std::size_t message, std::size_t first_iovec, std::size_t iovec_count, std::uint32_t frames);
+        void set_segment_size(std::size_t message, std::size_t segment_size);
+
+        // Sets up the messages for the fragments of a frame, each is sent straight from the
+        // serialized buffer with its headers in front of it. Advances message and iovec.
+        void add_fragments(std::size_t frame, bool segmented, std::size_t &message, std::size_t &iovec);
+
+        // Sends the packet serialized as reliable fragments, returns false if the channel doesn't take all of them
+        bool send_reliable_fragments(detail::reliable_sender &sender, std::uint8_t channel, packets::packet_id id);
+
+        // Receives acks and resends what wasn't acknowledged in time, runs in a thread
+        void run_reliability();
+        void receive_acks();
+        void stop_reliability();
+
+        // Datagrams handed to the kernel with a single call, also the most
+        // segments the kernel takes in a single buffer (UDP_MAX_SEGMENTS)
+        static constexpr std::size_t batch_size_ = 64;
+
+        // Only datagrams which don't need IP fragmentation on ethernet are segmented
+        // by the kernel, larger segments would fail on most routes.
+        static constexpr std::size_t max_segment_size_ = 1472;
+
+        // The largest UDP payload over IPv4, the most a segmented buffer may hold
+        static constexpr std::size_t max_segmented_length_ = 65507;
+
+        // The IPv4 and UDP headers in front of every datagram
+        static constexpr std::size_t udp_overhead_ = 28;
+
+        // Every IPv4 host takes datagrams of 576 bytes
+        static constexpr std::size_t min_datagram_size_ = 576 - udp_overhead_;
+
+        std::size_t max_datagram_size_ = max_segment_size_;
+
+        // The limit of the current send, taken once for all of its frames
+        std::size_t datagram_limit_ = max_segment_size_;
+
+        // Connected to the destination, only to ask the kernel for the path MTU (IP_MTU).
+        // 0 while it's unknown, asked for again at most once every interval.
+        SOCKET mtu_socket_ = -1;
+        std::size_t path_mtu_ = 0;
+        std::chrono::steady_clock::time_point path_mtu_checked_ = {};
+
+        static constexpr std::chrono::seconds path_mtu_interval_ = std::chrono::seconds(1);
+
+        // Numbers the packets split into fragments
+        std::uint32_t next_message_ = 0;
+
+        // Whether the kernel segments buffers for us (UDP_SEGMENT, Linux 4.18+). Checked
+        // once the socket is created, turned off if sending a segmented buffer ever fails.
+        bool segmentation_offload_ = false;
+
+        using segment_control = std::array<char, CMSG_SPACE(sizeof(std::uint16_t))>;
+
+        // Reused by every batch, so sending one doesn't allocate once they're large enough
+        std::vector<std::uint32_t> frame_offsets_ = {};
+        std::vector<iovec> iovecs_ = {};
+        std::vector<mmsghdr> messages_ = {};
+        std::vector<segment_control> controls_ = {};
+
+        using fragment_prefix = std::array<std::uint8_t, sizeof(packets::header) + sizeof(packets::fragment_header)>;
+        std::vector<fragment_prefix> fragment_headers_ = {};
+
+        // Amount of packets each message completes
+        std::vector<std::uint32_t> message_frames_ = {};
+
+        // The message number of each frame split into fragments, indexed like frame_offsets_
+        std::vector<std::uint32_t> frame_messages_ = {};
 
         SOCKET socket_ = 0;
         addrinfo *dest = nullptr;
 
         std::mutex send_mtx_ = {};
 
+        // A sender for each reliable delivery, indexed by the delivery - 1
+        std::mutex reliable_mtx_ = {};
+        std::array<detail::reliable_sender, 2> reliable_senders_ = {detail::reliable_sender(false), detail::reliable_sender(true)};
+
+        std::atomic<bool> reliability_running_ = false;
+        std::thread reliability_thread_ = {};
+
+        // The thread wakes up at least this often, even while nothing has to be resent
+        static constexpr std::chrono::milliseconds reliability_interval_ = std::chrono::milliseconds(50);
+
         // This will help us in serializing our packet data
         packets::detail::binary_serializer serializer = {};
 
@@ -74,8 +207,8 @@ namespace fi
                 connection_error,
                 packet_nullptr,
                 null_callback,
-                no_callback
-
+                no_callback,
+                packet_too_large
             };
 
             exception(reason_id reason, std::string_view what) : reason_(reason), what_(what) {};
@@ -0,0 +1,162 @@
+#include <cstdio>
+#include <map>
+#include <set>
+
+#include <poll.h>
+
+#include "../talker/async_talker/async_talker.h"
+
+static int failures = 0;
+
+static void check(bool passed, const char *condition, int line)
+{
+	if (passed)
+		return;
+
+	std::printf("%s:%d: %s failed\n", __FILE__, line, condition);
+	failures++;
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+struct blob_packet : fi::packets::packet<blob_packet, fi::packets::packet_id(61)>
+{
+	std::vector<std::uint8_t> data = {};
+
+	static constexpr auto fields = std::make_tuple(&blob_packet::data);
+};
+
+// What arrived of every packet split into fragments, by its message number
+using received_fragments = std::map<std::uint32_t, std::pair<std::uint16_t, std::set<std::uint16_t>>>;
+
+// Reads datagrams until none arrive for a while, returns how many weren't fragments
+static std::size_t receive(int s, received_fragments &fragments)
+{
+	std::uint8_t buffer[PACKET_BUFFER_SIZE];
+	std::size_t whole = 0;
+
+	pollfd readable = {s, POLLIN, 0};
+
+	while (poll(&readable, 1, 200) == 1)
+	{
+		auto length = recv(s, buffer, sizeof(buffer), 0);
+
+		if (length < ssize_t(sizeof(fi::packets::header)))
+			continue;
+
+		fi::packets::header header = {};
+		memcpy(&header, buffer, sizeof(header));
+
+		if (!(header.flags & fi::packets::flags::fl_fragment))
+		{
+			whole++;
+			continue;
+		}
+
+		fi::packets::fragment_header fragment = {};
+		memcpy(&fragment, buffer + sizeof(header), sizeof(fragment));
+
+		auto &entry = fragments[fragment.message];
+
+		entry.first = fragment.count;
+		entry.second.insert(fragment.index);
+	}
+
+	return whole;
+}
+
+static bool is_complete(const received_fragments::mapped_type &entry)
+{
+	return entry.first && entry.second.size() == entry.first;
+}
+
+// Segmented sends of sockets which don't checksum fail with EINVAL,
+// which makes the talker fall back to plain datagrams.
+static void break_segmentation(int receiver)
+{
+	for (int fd = 3; fd < 1024; fd++)
+	{
+		int type = 0;
+		socklen_t length = sizeof(type);
+
+		if (fd == receiver || getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) != 0 || type != SOCK_DGRAM)
+			continue;
+
+		int enabled = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NO_CHECK, &enabled, sizeof(enabled));
+	}
+}
+
+static void test_fallback_keeps_message_numbers()
+{
+	int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t length = sizeof(address);
+
+	bind(receiver, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+	getsockname(receiver, reinterpret_cast<sockaddr *>(&address), &length);
+
+	// Enough room for every datagram of the test
+	int buffer_size = 4 * 1024 * 1024;
+	setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+	fi::async_udp_talker talker = {};
+	talker.set_destination("127.0.0.1", std::to_string(ntohs(address.sin_port)));
+
+	if (!talker.has_segmentation_offload())
+	{
+		std::printf("segmentation offload unsupported, skipping the fallback test\n");
+		close(receiver);
+		return;
+	}
+
+	blob_packet small = {}, large = {};
+
+	small.data.assign(100, 1);
+	large.data.assign(5000, 2);
+
+	// Learn the message number the talker is at
+	received_fragments fragments = {};
+
+	CHECK(talker.send_packet(&large));
+	receive(receiver, fragments);
+
+	CHECK(fragments.size() == 1);
+
+	if (fragments.empty())
+	{
+		close(receiver);
+		return;
+	}
+
+	auto first = fragments.begin()->first;
+
+	// The small packet goes out on its own, the fragments of the large ones are segmented and
+	// fail. Both are sent again as plain datagrams, under the numbers they were given before.
+	break_segmentation(receiver);
+
+	fi::packets::base_packet *batch[] = {&small, &large, &large};
+
+	CHECK(talker.send_batch(batch) == 3);
+	CHECK(!talker.has_segmentation_offload());
+
+	fragments.clear();
+
+	CHECK(receive(receiver, fragments) == 1);
+	CHECK(fragments.size() == 2);
+	CHECK(fragments.count(first + 1) && is_complete(fragments[first + 1]));
+	CHECK(fragments.count(first + 2) && is_complete(fragments[first + 2]));
+
+	close(receiver);
+}
+
+int main()
+{
+	test_fallback_keeps_message_numbers();
+
+	return failures ? 1 : 0;
+}
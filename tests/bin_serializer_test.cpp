@@ -0,0 +1,75 @@
+#include <cstdio>
+
+#include "../shared/bin_serializer/bin_serializer.h"
+
+using fi::packets::detail::binary_serializer;
+using fi::packets::detail::encoding;
+
+static int failures = 0;
+
+static void check(bool passed, const char *condition, int line)
+{
+	if (passed)
+		return;
+
+	std::printf("%s:%d: %s failed\n", __FILE__, line, condition);
+	failures++;
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// Reads a single compact uint32 from the bytes, returns whether that failed
+static bool read_compact(std::vector<std::uint8_t> bytes, std::uint32_t &value)
+{
+	binary_serializer serializer = {};
+
+	// Borrowing resets the encoding
+	serializer.borrow_buffer(bytes.data(), std::uint32_t(bytes.size()));
+	serializer.set_encoding(encoding::compact);
+	serializer.deserialize(value);
+
+	return serializer.has_failed();
+}
+
+static void test_varint_round_trip()
+{
+	for (std::uint32_t expected : {0u, 1u, 127u, 128u, 300u, 16383u, 16384u, 0xffffffffu})
+	{
+		binary_serializer serializer = {};
+
+		serializer.set_encoding(encoding::compact);
+		serializer.serialize(expected);
+
+		auto data = serializer.get_serialized_data();
+		std::uint32_t value = 0;
+
+		CHECK(!read_compact({data, data + serializer.get_serialized_data_length()}, value));
+		CHECK(value == expected);
+	}
+}
+
+static void test_overlong_varint()
+{
+	std::uint32_t value = 0;
+
+	// 1 encoded in two bytes instead of one, taken by the two byte fast path
+	CHECK(read_compact({0x81, 0x00}, value));
+
+	// And the longer ones, decoded byte by byte
+	CHECK(read_compact({0x80, 0x80, 0x00}, value));
+	CHECK(read_compact({0xff, 0xff, 0x80, 0x00}, value));
+
+	// 0 is a single 0 byte
+	CHECK(read_compact({0x80, 0x00}, value));
+
+	CHECK(!read_compact({0x81, 0x01}, value));
+	CHECK(value == 129);
+}
+
+int main()
+{
+	test_varint_round_trip();
+	test_overlong_varint();
+
+	return failures ? 1 : 0;
+}
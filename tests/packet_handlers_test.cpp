@@ -0,0 +1,137 @@
+#include <cstdio>
+
+#include "../shared/packet_handlers/packet_handlers.h"
+
+using fi::packets::detail::binary_serializer;
+
+static int failures = 0;
+
+static void check(bool passed, const char *condition, int line)
+{
+	if (passed)
+		return;
+
+	std::printf("%s:%d: %s failed\n", __FILE__, line, condition);
+	failures++;
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+struct counter_packet : fi::packets::packet<counter_packet, fi::packets::packet_id(60)>
+{
+	std::uint32_t value = 0;
+
+	static constexpr auto fields = std::make_tuple(&counter_packet::value);
+};
+
+// Serializes the packet and points the reader at it
+static void load(binary_serializer &reader, binary_serializer &writer, std::uint32_t value)
+{
+	counter_packet packet = {};
+	packet.value = value;
+
+	writer.reset();
+	packet.serialize(writer);
+
+	reader.borrow_buffer(writer.get_serialized_data(), writer.get_serialized_data_length());
+}
+
+static void test_registries_keep_their_own_instances()
+{
+	fi::detail::packet_handlers<int> first = {}, second = {};
+	binary_serializer reader = {}, writer = {};
+	counter_packet *first_packet = nullptr;
+
+	// Both handlers are of the same type, as if registered from the same place
+	using handler = std::function<void(int, counter_packet &)>;
+
+	first.on<counter_packet>(handler([&](int, counter_packet &packet)
+									 {
+		first_packet = &packet;
+
+		// Dispatching to another registry from within the handler
+		// must leave the packet we hold alone.
+		binary_serializer inner_reader = {}, inner_writer = {};
+		load(inner_reader, inner_writer, 2);
+
+		CHECK(second.dispatch(0, packet.get_id(), inner_reader));
+		CHECK(packet.value == 1); }));
+
+	second.on<counter_packet>(handler([&](int, counter_packet &packet)
+									  {
+		CHECK(&packet != first_packet);
+		CHECK(packet.value == 2); }));
+
+	load(reader, writer, 1);
+	CHECK(first.dispatch(0, counter_packet{}.get_id(), reader));
+}
+
+static void test_nested_dispatch_gets_another_instance()
+{
+	fi::detail::packet_handlers<int> handlers = {};
+	binary_serializer reader = {}, writer = {};
+	counter_packet *outer = nullptr;
+	int depth = 0, max_depth = 12;
+
+	// Deep enough to run out of instances, the rest decode into temporaries
+	handlers.on<counter_packet>([&](int, counter_packet &packet)
+								{
+		if (!depth)
+			outer = &packet;
+		else
+			CHECK(&packet != outer);
+
+		auto value = packet.value;
+
+		if (++depth < max_depth)
+		{
+			binary_serializer inner_reader = {}, inner_writer = {};
+			load(inner_reader, inner_writer, value + 1);
+
+			CHECK(handlers.dispatch(0, packet.get_id(), inner_reader));
+		}
+
+		CHECK(packet.value == value); });
+
+	load(reader, writer, 0);
+	CHECK(handlers.dispatch(0, counter_packet{}.get_id(), reader));
+	CHECK(depth == max_depth);
+
+	// Every instance was handed back, so the next packet is decoded into the same one
+	auto first = outer;
+
+	depth = 0;
+	max_depth = 1;
+
+	load(reader, writer, 0);
+	CHECK(handlers.dispatch(0, counter_packet{}.get_id(), reader));
+	CHECK(outer == first);
+	CHECK(handlers.get_stats(counter_packet{}.get_id()).received == 13);
+}
+
+static void test_malformed_packets_are_counted()
+{
+	fi::detail::packet_handlers<int> handlers = {};
+	binary_serializer reader = {};
+	bool called = false;
+
+	handlers.on<counter_packet>([&](int, counter_packet &)
+								{ called = true; });
+
+	// Too short for the value
+	std::uint8_t data[] = {1};
+	reader.borrow_buffer(data, sizeof(data));
+
+	CHECK(!handlers.dispatch(0, counter_packet{}.get_id(), reader));
+	CHECK(!called);
+	CHECK(handlers.get_stats(counter_packet{}.get_id()).malformed == 1);
+}
+
+int main()
+{
+	test_registries_keep_their_own_instances();
+	test_nested_dispatch_gets_another_instance();
+	test_malformed_packets_are_counted();
+
+	return failures ? 1 : 0;
+}